@@ -1,6 +1,9 @@
 [org 0x7C00]
 
-kernel_offset equ 0x1000
+kernel_offset equ 0x10000
+kernel_segment equ kernel_offset >> 4
+
+%include "./asm/kernel_size.asm"
 
 jmp short _start
 nop
@@ -13,11 +16,11 @@ reservedSectors			dw 1
 fatCount				db 2
 rootDirectoryEntries	dw 224
 sectorCount				dw 2880
-mediaDescriptorType		db 0b11111000
+mediaDescriptorType		db 0xF0
 sectorsPerFat			dw 9
 sectorsPerTrack			dw 18
 headCount				dw 2
-hiddenSectorCount		db 0
+hiddenSectorCount		dd 0
 largeSectorCount		dd 0
 
 ; Extended Boot Record
@@ -26,7 +29,7 @@ reserved				db 0
 signature				db 29h
 volumeID				db 00h, 00h, 00h, 00h
 volumeLabel				db "BOOT FLOPPY"
-systemID				db "FAT16   "
+systemID				db "FAT12   "
 
 _start:
 	mov bp, 0x8000		; Setup stack and frame pointers
@@ -41,10 +44,25 @@ _start:
 
 [bits 16]
 load_kernel:
-	mov bx, kernel_offset 
-	mov dh, 48			; Load 18 (the maximum) amount of sectors in the first head and cylinder
+	mov ax, kernel_segment	; The kernel lives above 64 KiB, so load it through es:bx
+	mov es, ax
+	xor bx, bx
+	mov dh, KERNEL_FIRST_PART	; The first part of the kernel image
+	mov ch, KERNEL_START_LBA / 36
+	mov ah, (KERNEL_START_LBA % 36) / 18
+	mov cl, KERNEL_START_LBA % 18 + 1
 	call disk_load		; Load the disk so we can properly start the kernel
 
+	mov ax, kernel_segment + KERNEL_FIRST_PART * 512 / 16	; The rest follows right after it
+	mov es, ax
+	mov dh, KERNEL_SECTORS - KERNEL_FIRST_PART
+	mov ch, (KERNEL_START_LBA + KERNEL_FIRST_PART) / 36
+	mov ah, ((KERNEL_START_LBA + KERNEL_FIRST_PART) % 36) / 18
+	mov cl, (KERNEL_START_LBA + KERNEL_FIRST_PART) % 18 + 1
+	call disk_load
+	xor ax, ax
+	mov es, ax
+
 	; Put your code here to disable the blinking cursor
 	; The blinking cursor can only be disabled in real mode using BIOS interrupt int 0x10
 
@@ -1,13 +1,13 @@
+; Reads dh sectors from the boot floppy into [es:bx]
+; starting at cylinder ch, head ah, sector cl
 disk_load:
 	pusha 
 	push dx			; number of sectors (input parameter)
 
-	mov ah, 0x02 	; read function 
 	mov al, dh 		; number of sectors
+	mov dh, ah 		; head number
+	mov ah, 0x02 	; read function 
 	mov dl, 0x00 	; drive number
-	mov dh, 0x01 	; head number
-	mov ch, 0x00 	; cylinder number  
-	mov cl, 0x10 	; sector number 
 
 	; read data to [es:bx] 
 	int 0x13
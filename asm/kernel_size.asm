@@ -0,0 +1,13 @@
+; Boot layout: the bootloader reads the kernel image to 0x10000 (linked there with -Ttext 0x10000 and -N,
+; so ld doesn't pad the sections to pages), the user stack grows down from 0xF000 below it
+
+; Number of sectors the kernel image occupies on the floppy (one cluster each)
+; The bootloader loads this many sectors, the FAT and root directory reserve them
+; 128 sectors fill 0x10000 - 0x1FFFF, right up to the FATs at 0x20000
+%define KERNEL_SECTORS 128
+
+; The kernel is the first file in the data area (cluster 2)
+%define KERNEL_START_LBA 33
+
+; The BIOS reads at most 72 floppy sectors per int 0x13 call, so the kernel is loaded in two parts
+%define KERNEL_FIRST_PART 72
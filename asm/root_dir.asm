@@ -1,3 +1,5 @@
+%include "./asm/kernel_size.asm"
+
 ; Root Directory Contents
 rootDir:
 fileName            db "kernel  "
@@ -11,5 +13,5 @@ ignored             dw 0
 lastWriteTime       dw 0
 lastWriteDate       dw 0
 startingCluster     dw 2
-fileSize            dd 24576
+fileSize            dd KERNEL_SECTORS * 512
 times (512 * 14) - ($ - rootDir) db 0
\ No newline at end of file
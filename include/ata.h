@@ -0,0 +1,33 @@
+#include "./types.h"
+
+// Primary master, primary slave, secondary master, secondary slave
+#define ATA_MAX_DRIVES      4
+#define ATA_SECTOR_SIZE     512
+
+// What we learned about a drive from IDENTIFY DEVICE, see ata_get_info()
+typedef struct
+{
+    uint8 present;
+    uint8 lba48;            // supports the 48-bit commands
+    uint8 dma;              // supports DMA and sits on a channel with a bus master
+    uint32 sectorCount;     // addressable sectors (capped at 2^32 - 1 for big LBA48 drives)
+    char model[41];
+} ata_drive_info_t;
+
+// Why an ATA transfer failed
+typedef enum
+{
+    ATA_OK = 0,
+    ATA_ERROR_NO_DRIVE,         // nothing (or an ATAPI device) at that position
+    ATA_ERROR_OUT_OF_RANGE,     // the transfer runs past the end of the drive
+    ATA_ERROR_TIMEOUT,          // the drive stayed busy
+    ATA_ERROR_DEVICE,           // the drive set ERR, the error register says why
+    ATA_ERROR_DEVICE_FAULT,     // the drive set DF
+    ATA_ERROR_DMA               // the bus master reported an error
+} ata_error_t;
+
+void ata_install();
+int ata_get_info(int drive, ata_drive_info_t *info);
+void ata_print_drives();
+int ata_read(int drive, uint32 lba, void *address, uint32 count);
+int ata_write(int drive, uint32 lba, void *address, uint32 count);
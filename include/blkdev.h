@@ -0,0 +1,52 @@
+#include "./types.h"
+
+// The most devices that can be registered, and the most requests blkdev_submit() sorts in one sweep
+#define BLKDEV_MAX_DEVICES      8
+#define BLKDEV_MAX_REQUESTS     32
+#define BLKDEV_SECTOR_SIZE      512
+
+// What a driver provides for its devices, count is in bytes (a multiple of BLKDEV_SECTOR_SIZE)
+typedef struct
+{
+    int (*read)(int unit, uint32 lba, void *address, uint32 count);
+    int (*write)(int unit, uint32 lba, void *address, uint32 count);
+    int (*cylinder)(int unit);  // where the heads are, -1 if unknown, may be 0 for devices without heads
+    int (*flush)(int unit);     // push out anything the driver still holds back, may be 0
+    int (*geometry)(int unit, uint32 sectorCount, uint16 sectorsPerTrack, uint16 heads);  // may be 0
+    int (*verify)(int unit, int enabled);   // check writes on the medium, returns the old setting, may be 0
+} blkdev_ops_t;
+
+// A registered device, see blkdev_register()
+typedef struct
+{
+    char name[8];
+    int unit;                   // the driver's own number for the device (floppy drive, ATA position, ...)
+    const blkdev_ops_t *ops;
+    uint32 sectorCount;
+    uint16 sectorsPerTrack;     // 0 for devices without tracks
+    uint16 heads;
+} blkdev_t;
+
+// One transfer handed to blkdev_submit()
+typedef struct blkdev_request
+{
+    int device;
+    int write;                  // 0 for a read, 1 for a write
+    uint32 lba;
+    uint8 *address;
+    uint32 count;               // in bytes
+    int status;                 // set on completion, 0 or the driver's error
+    void (*complete)(struct blkdev_request *request);  // called on completion, may be 0
+} blkdev_request_t;
+
+int blkdev_register(blkdev_t *device);
+int blkdev_find(char *name);
+blkdev_t *blkdev_get(int device);
+void blkdev_print_devices();
+int blkdev_submit(blkdev_request_t *requests, int count);
+void blkdev_queue(blkdev_request_t *requests, int *count, blkdev_request_t *request, int *error);
+int blkdev_flush(int device);
+int blkdev_set_geometry(int device, uint32 sectorCount, uint16 sectorsPerTrack, uint16 heads);
+int blkdev_set_write_verify(int device, int enabled);
+int blkdev_read(int device, uint32 lba, void *address, uint32 count);
+int blkdev_write(int device, uint32 lba, void *address, uint32 count);
@@ -0,0 +1,32 @@
+#include "./types.h"
+
+// Sector buffers live in low memory at 0x40000 - 0x4FFFF
+// Dirty sectors are gathered at 0x50000 - 0x5FFFF before they are written back
+#define CACHE_BUFFER_ADDRESS    0x40000
+#define CACHE_STAGING_ADDRESS   0x50000
+#define CACHE_MAX_BUFFERS       128
+#define CACHE_DEFAULT_BUFFERS   128
+
+// Sequential reads fetch up to this many sectors past the request (the rest of the track and the next one)
+#define CACHE_DEFAULT_READAHEAD         36
+#define CACHE_READAHEAD_MAX_TRANSFER    64
+#define CACHE_MAX_DEVICES               8
+
+// Counters kept by the cache, see cache_get_stats()
+typedef struct
+{
+    uint32 hits;        // sectors served from memory
+    uint32 misses;      // sectors that had to be read from the disk
+    uint32 writebacks;  // dirty sectors written to the disk
+    uint32 prefetched;  // sectors read ahead of time
+    uint32 prefetchHits;// sectors read ahead of time that were asked for later
+} cache_stats_t;
+
+void cache_init(uint32 bufferCount);
+void cache_invalidate(int device);
+int cache_read(int device, uint32 lba, void *address, uint32 count);
+void cache_set_readahead(uint32 sectors);
+int cache_write(int device, uint32 lba, void *address, uint32 count);
+int cache_sync();
+void cache_get_stats(cache_stats_t *stats);
+void cache_print_stats();
\ No newline at end of file
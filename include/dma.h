@@ -1,6 +1,15 @@
 #include "./types.h"
 
+// DMA-safe buffers are handed out from this reserved block of low memory
+// It is exactly one 64 KiB ISA DMA page, so no buffer can straddle a page boundary
+#define DMA_POOL_ADDRESS    0x60000
+#define DMA_POOL_SIZE       0x10000
+#define DMA_BLOCK_SIZE      512
+
 void maskChannel(uint8 channel, int masked);
 void initFloppyDMA(uint32 address, uint16 count);
 void prepare_for_floppyDMA_read();
-void prepare_for_floppyDMA_write();
\ No newline at end of file
+void prepare_for_floppyDMA_write();
+int dma_is_safe(uint32 address, uint32 count);
+void *dma_alloc(uint32 size);
+void dma_free(void *address, uint32 size);
\ No newline at end of file
@@ -28,13 +28,34 @@ typedef struct
 
 } __attribute__((packed)) boot_sector_t;
 
-typedef struct
-{
-    // File Allocation Table (FAT)
-    // We will use 16-bits for our entries
-    uint16 clusters[2304];
-
-} __attribute__((packed)) fat_t;
+// File Allocation Table (FAT)
+// On the disk every entry is 12 bits, two entries packed into three bytes (FAT12)
+// In memory we keep the entries decoded into 16 bits each, see fatClusters in fat.c
+#define FAT_MAX_ENTRIES         4096    // what 12 bits can number
+#define FAT_MAX_SECTORS         12      // 4096 entries of 12 bits
+#define FAT12_MAX_CLUSTERS      4084    // more and the volume would have to be FAT16
+
+// Clusters of one sector, or of two on volumes with more sectors than FAT12 can number (a 2.88MB floppy)
+#define FAT_MAX_SECTORS_PER_CLUSTER 2
+#define FAT_MAX_CLUSTER_SIZE    (FAT_MAX_SECTORS_PER_CLUSTER * 512)
+
+// Decoded entries, every FAT12 end of chain value (0xFF8 - 0xFFF) becomes FAT_END_OF_CHAIN
+#define FAT_FREE                0x0000
+#define FAT_BAD_CLUSTER         0x0FF7
+#define FAT_END_OF_CHAIN        0xFFFF
+
+// The decoded FAT lives above the kernel stack
+#define FAT_INDEX_ADDRESS       0x80000
+
+// The hash index over the root directory follows it (0x82000 - 0x85FFF)
+#define DIRECTORY_INDEX_ADDRESS 0x82000
+#define DIRECTORY_INDEX_SIZE    1024    // slots, a power of two and at least twice DIRECTORY_MAX_ENTRIES
+#define DIRECTORY_MAX_ENTRIES   512
+#define DIRECTORY_MISS_CACHE_SIZE 16    // names recently looked up and not found, a power of two
+
+// The first byte of the name of a deleted directory entry, and of the entry after the last one in use
+#define DIRECTORY_ENTRY_DELETED 0xE5
+#define DIRECTORY_ENTRY_END     0x00
 
 typedef struct
 {
@@ -54,14 +75,76 @@ typedef struct
 
 } __attribute__((packed)) directory_entry_t;
 
+// Most clusters a file can have, every cluster of the biggest volume we mount
+#define FILE_MAX_CLUSTERS FAT12_MAX_CLUSTERS
+
+// Most runs of neighbouring clusters a file can be made of
+#define FILE_MAX_EXTENTS 128
+
+// Most files open at once across all processes, every descriptor of the same file shares one of them
+// Their table follows the directory index, each is loaded whole into its own buffer above 16 MiB
+// init_fs() only uses as many slots as the machine has memory for their buffers, at least one
+#define FILE_MAX_OPEN           4
+#define FILE_TABLE_ADDRESS      0x86000
+#define FILE_BUFFER_ADDRESS     0x1000000
+#define FILE_BUFFER_SIZE        (FILE_MAX_CLUSTERS * FAT_MAX_CLUSTER_SIZE)
+
+// How a descriptor may use its file, see openFile()
+#define FILE_MODE_READ          1
+#define FILE_MODE_WRITE         2
+#define FILE_MODE_READ_WRITE    (FILE_MODE_READ | FILE_MODE_WRITE)
+#define FILE_MODE_LAZY          4       // only find the clusters on open, read them as they are touched
+
+// Clusters a lazily loaded file keeps in memory at once (at most 32, see file_t.windowLoaded)
+#define FILE_WINDOW_CLUSTERS    32
+
+// Where seekFile() counts the offset from
+#define FILE_SEEK_SET           0
+#define FILE_SEEK_CURRENT       1
+#define FILE_SEEK_END           2
+
+// What readFile(), writeFile() and seekFile() return when they fail, negative so it can't be taken for a count or an offset
+typedef enum
+{
+    FILE_ERROR_BAD_DESCRIPTOR = -1,     // not a file the running process has open, or not open for reading / writing
+    FILE_ERROR_INVALID = -2,            // a seek before the start or past the biggest a file can get, or an unknown whence
+    FILE_ERROR_TOO_BIG = -3,            // the file would grow past FILE_BUFFER_SIZE
+    FILE_ERROR_NO_SPACE = -4,           // there is no room left on the disk to grow the file into
+    FILE_ERROR_IO = -5,                 // the device could not read part of the file
+} file_error_t;
+
+// A run of clusters that follow each other on the disk and in the file
+typedef struct
+{
+    uint32 fileCluster;     // where in the file the run starts, counted in clusters
+    uint16 startCluster;
+    uint16 length;
+} __attribute__((packed)) file_extent_t;
+
+// A file loaded into memory, shared by every descriptor that has it open (a process's descriptors are in its proc_t)
 typedef struct
 {
-    uint32 index;
     uint8 *startingAddress;
 
-    // Set to 0 if not opened
-    // Set to non-zero if opened
-    char isOpened; // is closed by default 
+    // The file's size when it was opened, closeFile() only rewrites the directory entry if it changed
+    uint32 openedSize;
+
+    // One bit per cluster of the file (in file order) that was written to since it was opened
+    uint8 dirtyClusters[(FILE_MAX_CLUSTERS + 7) / 8];
+
+    // A lazily loaded file only has a window of FILE_WINDOW_CLUSTERS clusters in its buffer, starting at windowStart
+    // windowLoaded has a bit for every cluster of the window that was read in, a file loaded on open is all one window
+    uint8 lazy;
+    uint32 windowStart;
+    uint32 windowLoaded;
+
+    // The file's cluster chain as runs, in file order, so nothing has to follow the FAT while the file is open
+    file_extent_t extents[FILE_MAX_EXTENTS];
+    uint32 extentCount;
+    uint32 clusterCount;
+
+    // Descriptors that have the file open, 0 if this slot of the table is free
+    uint32 references;
 
     // The directory entry for the file, containing all its metadata
     directory_entry_t *directoryEntry;
@@ -81,17 +164,24 @@ typedef struct
 
 } __attribute__((packed)) directory_t;
 
-void init_fs();
+int init_fs(int device);
+int canMakeFileSystem(int device);
+int makeFileSystem(int device);
 int openDirectory(directory_t *directory);
-int openFile(char *filename, char* ext);
-int closeFile();
+int openFile(char *filename, char* ext, int mode);
+int loadFileToDevice(char *filename, char *ext, int device);
+int closeFile(int fd);
+void closeProcessFiles();
+int truncateFile(int fd, uint32 size);
+void setWriteVerify(int enabled);
 int createDirectory(directory_t *directory);
 int createFile(char *filename, char* ext);
 void deleteDirectory(directory_t *file);
-int deleteFile();
-uint8 readByte(uint32 index);
-uint8 readNextByte();
-int writeByte(uint8 byte, uint32 index);
-int writeBytes(uint8 byte, uint32 count);
-int writeNextByte(uint8 byte);
+int deleteFile(int fd);
+int readFile(int fd, void *buffer, uint32 length);
+int writeFile(int fd, void *buffer, uint32 length);
+int readFileAt(int fd, void *buffer, uint32 length, uint32 offset);
+int writeFileAt(int fd, void *buffer, uint32 length, uint32 offset);
+int seekFile(int fd, int offset, int whence);
+int fileExists(char *filename, char *ext);
 int findFile(char *filename, char* ext, directory_t directory, directory_entry_t *foundEntry);
\ No newline at end of file
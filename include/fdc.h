@@ -1,6 +1,61 @@
 #include "./types.h"
 #include "./io.h"
+
+// Counters kept per drive, see floppy_get_stats()
+typedef struct
+{
+    uint32 seeks;           // SEEK commands we had to issue
+    uint32 seeksAvoided;    // transfers that found the heads on the right cylinder already
+    uint32 timingBackoffs;  // times the SPECIFY timings were slowed down after an error
+    uint32 timingSpeedups;  // times they were sped up again after a run of clean transfers
+    uint32 retries;         // failed attempts that were tried again
+    uint32 recalibrations;  // RECALIBRATE commands, including the ones at start-up
+    uint32 crcErrors;       // attempts that failed a data or ID field CRC
+    uint32 overruns;        // attempts the DMA controller didn't keep up with
+    uint32 failures;        // transfers we gave up on
+    uint32 verifies;        // VERIFY commands issued after a write
+    uint32 verifyFailures;  // writes whose VERIFY failed and had to be written again
+} floppy_stats_t;
+
+// Why a floppy transfer failed, see floppy_classify()
+typedef enum
+{
+    FLOPPY_OK = 0,
+    FLOPPY_ERROR_CRC,                   // the data or ID field of a sector failed its CRC
+    FLOPPY_ERROR_NO_DATA,               // the sector wasn't found on the track
+    FLOPPY_ERROR_OVERRUN,               // the DMA controller didn't keep up with the drive
+    FLOPPY_ERROR_WRITE_PROTECT,         // the disk is write protected
+    FLOPPY_ERROR_MISSING_ADDRESS_MARK,  // no ID or data address mark, usually an unformatted track
+    FLOPPY_ERROR_SEEK,                  // the heads ended up on the wrong cylinder
+    FLOPPY_ERROR_NOT_READY,             // no disk, or the drive went away during the command
+    FLOPPY_ERROR_INVALID_COMMAND,
+    FLOPPY_ERROR_NO_BUFFER,             // no bounce buffer for a buffer the DMA controller can't reach
+    FLOPPY_ERROR_UNKNOWN
+} floppy_error_t;
+
+// Sector layout floppy_format() uses unless told otherwise
+// The controller switches heads by itself without losing time, only a step to the next cylinder needs a skew
+#define FLOPPY_FORMAT_INTERLEAVE    1
+#define FLOPPY_FORMAT_HEAD_SKEW     0
+
+void lba_2_chs(int drive, uint32 lba, uint16* cyl, uint16* head, uint16* sector);
 void floppy_detect_drives();
+void floppy_install();
+void floppy_set_motor_timeout(uint32 ms);
+int floppy_get_drive_type(int drive);
+int floppy_get_sectors_per_track(int drive);
+uint32 floppy_get_sector_count(int drive);
+int floppy_set_geometry(int drive, uint32 sectorCount, uint16 sectorsPerTrack, uint16 heads);
+int floppy_get_cylinder(int drive);
+void floppy_get_stats(int drive, floppy_stats_t *stats);
+void floppy_print_stats(int drive);
+char *floppy_error_name(floppy_error_t error);
+void floppy_set_auto_tune(int enabled);
+int floppy_set_write_verify(int drive, int enabled);
+int floppy_get_timing_level(int drive);
+void floppy_set_timing_level(int drive, int level);
 int floppy_init();
-int floppy_read(int drive, uint32 lba, void* address, uint16 count);
-int floppy_write(int drive, uint32 lba, void* address, uint16 count);
\ No newline at end of file
+int floppy_read(int drive, uint32 lba, void* address, uint32 count);
+int floppy_write(int drive, uint32 lba, void* address, uint32 count);
+int floppy_cylinder_skew(int drive);
+int floppy_format(int drive, int interleave, int headSkew, int cylinderSkew);
\ No newline at end of file
@@ -7,6 +7,9 @@
 // The maximum number of total procs
 #define MAX_PROCS MAX_USER_PROCS + MAX_KERN_PROCS
 
+// The most files a process can have open at once
+#define MAX_PROC_FILES 8
+
 // All possible statuses for processes
 typedef enum
 {
@@ -14,6 +17,7 @@ typedef enum
     PROC_STATUS_RUNNING,
 	PROC_STATUS_READY,
 	PROC_STATUS_TERMINATED,
+	PROC_STATUS_WAITING,
 } proc_status_t;
 
 // All possible types of processes
@@ -26,6 +30,25 @@ typedef enum
 } proc_type_t;
 
 
+// A process's handle on an open file, returned by openFile() as its index in proc_t.files
+// Descriptors have their own offset and mode, the file itself may be shared with other descriptors (see fat.c)
+typedef struct
+{
+	int file;		// Index into the open file table, -1 if the descriptor is free
+	uint32 offset;	// Where the next read or write happens
+	int mode;		// FILE_MODE_READ and/or FILE_MODE_WRITE
+} proc_file_t;
+
+// A lock a process sleeps on (see wait_event()) while another process holds it
+// Processes only switch when they yield or wait, so taking a free lock can't be interrupted by another process
+// The kernel process must not wait for a lock a user process holds, it would never give the CPU back
+typedef struct
+{
+	volatile int free;	// the event waiters are parked on, taking the lock clears it
+} sleeplock_t;
+
+#define SLEEPLOCK_INIT {1}
+
 // Process control block
 // Contains all registers and info for each process
 typedef struct
@@ -45,12 +68,19 @@ typedef struct
 	uint32 cs;
 	uint32 cr3;
 	void *eip;
+	volatile int *waitEvent;	// What a waiting process is parked on (see wait_event())
+	proc_file_t files[MAX_PROC_FILES];	// File descriptors
 } proc_t;
 
 int schedule();
 int createproc(void *func, char *stack);
 int startkernel(void func());
 int ready_process_count();
+int waiting_process_count();
+void wake_waiting();
+void wait_event(volatile int *event);
+void lock_acquire(sleeplock_t *lock);
+void lock_release(sleeplock_t *lock);
 void runproc(proc_t proc);
 void yield();
 void contextswitch();
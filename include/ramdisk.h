@@ -0,0 +1,16 @@
+#include "./types.h"
+
+// RAM disks are handed out from the memory above the first MiB up to 16 MiB, open files are loaded above that
+// ramdisk_create() turns A20 on, otherwise every odd MiB would wrap around to the one below
+#define RAMDISK_ADDRESS         0x100000
+#define RAMDISK_MEMORY_END      0x1000000
+#define RAMDISK_MAX_DISKS       2
+
+// Big enough for a 2.88MB floppy image
+#define RAMDISK_MAX_SECTORS     5760
+
+int a20_enable();
+uint32 memory_end();
+int ramdisk_create(uint32 sectorCount);
+int ramdisk_load(int device, int source, uint32 sourceLba);
+void ramdisk_set_write_back(int device, int enabled);
@@ -1,4 +1,7 @@
-void printFileName(directory_entry_t *entry);
+#include "./types.h"
+
 void scanfWithPadding(char *string, char paddingChar, int length);
 void stringcopy(char *src, char *dest, int length);
-char stringcompare(char *string0, char *string1, int length);
\ No newline at end of file
+char stringcompare(char *string0, char *string1, int length);
+void memorycopy(void *src, void *dest, uint32 length);
+void memoryset(void *dest, uint8 value, uint32 length);
\ No newline at end of file
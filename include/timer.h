@@ -0,0 +1,12 @@
+#include "./types.h"
+
+// The PIT is programmed to fire IRQ0 this many times per second
+#define TIMER_HZ 100
+
+// Convert milliseconds to timer ticks (rounded up, so short delays never become 0)
+#define TIMER_MS_TO_TICKS(ms) (((ms) * TIMER_HZ + 999) / 1000)
+
+void timer_install();
+uint32 timer_get_ticks();
+void timer_sleep(uint32 ticks);
+int timer_add_callback(void (*callback)());
\ No newline at end of file
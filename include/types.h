@@ -1,10 +1,14 @@
-// Signed integers (8 bit, 16 bit, and 32 bit)
+// Signed integers (8 bit, 16 bit, 32 bit, and 64 bit)
 typedef signed      char        int8;
 typedef signed      short       int16;
 typedef signed      int         int32;
+typedef signed      long long   int64;
 
-// Unsigned integers (8 bit, 16 bit, and 32 bit)
+// Unsigned integers (8 bit, 16 bit, 32 bit, and 64 bit)
 typedef unsigned    char        uint8;
 typedef unsigned    short       uint16;
 typedef unsigned    int         uint32;
+typedef unsigned    long long   uint64;
+
+// We don't link libgcc, so 64 bit integers can be shifted, masked and compared but not divided
 
@@ -0,0 +1,566 @@
+#include "./types.h"
+#include "./io.h"
+#include "./irq.h"
+#include "./multitasking.h"
+#include "./ata.h"
+#include "./blkdev.h"
+#include "./string.h"
+
+/*
+ * https://wiki.osdev.org/ATA_PIO_Mode
+ * https://wiki.osdev.org/ATA/ATAPI_using_DMA
+ * Two legacy IDE channels with up to two drives each, like Bochs and QEMU give us
+ */
+
+// Registers, as offsets from a channel's command block
+enum ATARegisters
+{
+    ATA_REGISTER_DATA           = 0,
+    ATA_REGISTER_ERROR          = 1,    // read-only
+    ATA_REGISTER_SECTOR_COUNT   = 2,
+    ATA_REGISTER_LBA_LOW        = 3,
+    ATA_REGISTER_LBA_MID        = 4,
+    ATA_REGISTER_LBA_HIGH       = 5,
+    ATA_REGISTER_DRIVE_SELECT   = 6,
+    ATA_REGISTER_STATUS         = 7,    // read-only
+    ATA_REGISTER_COMMAND        = 7     // write-only
+};
+
+enum ATACommands
+{
+    ATA_READ_SECTORS            = 0x20,
+    ATA_READ_SECTORS_EXT        = 0x24,
+    ATA_READ_DMA_EXT            = 0x25,
+    ATA_WRITE_SECTORS           = 0x30,
+    ATA_WRITE_SECTORS_EXT       = 0x34,
+    ATA_WRITE_DMA_EXT           = 0x35,
+    ATA_READ_DMA                = 0xC8,
+    ATA_WRITE_DMA               = 0xCA,
+    ATA_FLUSH_CACHE             = 0xE7,
+    ATA_FLUSH_CACHE_EXT         = 0xEA,
+    ATA_IDENTIFY                = 0xEC
+};
+
+// The status byte
+#define ATA_STATUS_ERR      0x01
+#define ATA_STATUS_DRQ      0x08
+#define ATA_STATUS_DF       0x20
+#define ATA_STATUS_BSY      0x80
+
+// Bus master registers, as offsets from a channel's bus master block
+#define BMIDE_COMMAND       0
+#define BMIDE_STATUS        2
+#define BMIDE_PRDT          4
+
+// Bus master command and status bits
+#define BMIDE_START         0x01
+#define BMIDE_READ          0x08    // the bus master writes to memory
+#define BMIDE_STATUS_ERROR  0x02
+#define BMIDE_STATUS_IRQ    0x04
+
+// PCI configuration space, see ata_find_bus_master()
+#define PCI_CONFIG_ADDRESS  0xCF8
+#define PCI_CONFIG_DATA     0xCFC
+
+// The most sectors we move with one command, 64 KiB keeps a PRD table small and works for LBA28 too
+#define ATA_MAX_SECTORS_PER_COMMAND     128
+
+// How many times we look at the status register before we give up on a busy drive
+#define ATA_POLL_LIMIT      1000000
+
+// One entry of a Physical Region Descriptor table, a piece of the buffer the bus master moves
+typedef struct
+{
+    uint32 address;
+    uint16 byteCount;       // 0 means 64 KiB
+    uint16 flags;           // 0x8000 marks the last entry
+} __attribute__((packed)) ata_prd_t;
+
+// A 64 KiB transfer touches at most two 64 KiB pages, the spare entry keeps us honest
+#define ATA_PRD_ENTRIES     4
+
+typedef struct
+{
+    uint16 base;            // command block
+    uint16 control;         // device control / alternate status
+    uint16 busMaster;       // bus master block, 0 if there is none
+    int irq;
+    volatile int irqReceived;
+
+    // The bus master reads the table by physical address, it must not cross a 64 KiB boundary
+    ata_prd_t prdt[ATA_PRD_ENTRIES] __attribute__((aligned(32)));
+
+    // Held for a whole transfer, the drives of a channel share its registers, IRQ and PRD table
+    sleeplock_t lock;
+} ata_channel_t;
+
+static ata_channel_t ata_channels[2] = {
+    {0x1F0, 0x3F6, 0, 14, 0, {{0, 0, 0}}, SLEEPLOCK_INIT},
+    {0x170, 0x376, 0, 15, 0, {{0, 0, 0}}, SLEEPLOCK_INIT}
+};
+
+static ata_drive_info_t ata_drives[ATA_MAX_DRIVES];
+
+
+/*
+ * ATA Util
+ */
+
+// Reading the alternate status four times gives the drive the 400ns it needs after a select or command
+uint8 ata_delay(ata_channel_t *channel){
+    inb(channel->control);
+    inb(channel->control);
+    inb(channel->control);
+    return inb(channel->control);
+}
+
+// Wait for the drive to clear BSY, returns the status or -1 if it never does
+int ata_wait_ready(ata_channel_t *channel){
+    for(int i = 0; i < ATA_POLL_LIMIT; i++){
+        uint8 status = inb(channel->control);
+        if(!(status & ATA_STATUS_BSY)){
+            return status;
+        }
+    }
+    return -1;
+}
+
+// Turns the status after a command into an error
+ata_error_t ata_check_status(int status){
+    if(status < 0) return ATA_ERROR_TIMEOUT;
+    if(status & ATA_STATUS_DF) return ATA_ERROR_DEVICE_FAULT;
+    if(status & ATA_STATUS_ERR) return ATA_ERROR_DEVICE;
+    return ATA_OK;
+}
+
+/*
+ * IRQ14/IRQ15 handler, reading the status register acknowledges the interrupt in the drive
+ */
+void ata_irq_handler(regs *r){
+    ata_channel_t *channel = &ata_channels[r->int_no - 32 == 15];
+    inb(channel->base + ATA_REGISTER_STATUS);
+    channel->irqReceived = 1;
+}
+
+/*
+ * Park the calling process until the channel raises its IRQ
+ */
+void ata_wait_irq(ata_channel_t *channel){
+    wait_event(&channel->irqReceived);
+}
+
+uint32 pci_config_read(int bus, int device, int function, int offset){
+    outl(PCI_CONFIG_ADDRESS, 0x80000000 | (bus << 16) | (device << 11) | (function << 8) | (offset & 0xFC));
+    return inl(PCI_CONFIG_DATA);
+}
+
+void pci_config_write(int bus, int device, int function, int offset, uint32 value){
+    outl(PCI_CONFIG_ADDRESS, 0x80000000 | (bus << 16) | (device << 11) | (function << 8) | (offset & 0xFC));
+    outl(PCI_CONFIG_DATA, value);
+}
+
+/*
+ * https://wiki.osdev.org/PCI_IDE_Controller
+ * Look on bus 0 for an IDE controller that can bus master (a PIIX in Bochs and QEMU)
+ * BAR4 holds the I/O base of its bus master registers, the secondary channel's are 8 bytes further
+ */
+void ata_find_bus_master(){
+    for(int device = 0; device < 32; device++){
+        for(int function = 0; function < 8; function++){
+            uint32 id = pci_config_read(0, device, function, 0x00);
+            if((id & 0xFFFF) == 0xFFFF){
+                if(function == 0) break;
+                continue;
+            }
+
+            // Class 01 (mass storage), subclass 01 (IDE), programming interface bit 7 (bus master)
+            uint32 class = pci_config_read(0, device, function, 0x08);
+            if((class >> 16) != 0x0101 || !(class & 0x8000)){
+                continue;
+            }
+
+            uint32 bar4 = pci_config_read(0, device, function, 0x20);
+            if(!(bar4 & 1)){
+                continue;
+            }
+
+            // Let the controller answer I/O and master the bus
+            uint32 command = pci_config_read(0, device, function, 0x04);
+            pci_config_write(0, device, function, 0x04, command | 0x05);
+
+            ata_channels[0].busMaster = bar4 & 0xFFFC;
+            ata_channels[1].busMaster = (bar4 & 0xFFFC) + 8;
+            return;
+        }
+    }
+}
+
+/*
+ * https://wiki.osdev.org/ATA_PIO_Mode#IDENTIFY_command
+ * Fills in ata_drives[drive], leaves it marked absent if there is no ATA drive there
+ */
+void ata_identify(int drive){
+    ata_channel_t *channel = &ata_channels[drive / 2];
+    ata_drive_info_t *info = &ata_drives[drive];
+    uint16 identify[256];
+
+    info->present = 0;
+
+    outb(channel->base + ATA_REGISTER_DRIVE_SELECT, 0xA0 | ((drive & 1) << 4));
+    ata_delay(channel);
+    outb(channel->base + ATA_REGISTER_SECTOR_COUNT, 0);
+    outb(channel->base + ATA_REGISTER_LBA_LOW, 0);
+    outb(channel->base + ATA_REGISTER_LBA_MID, 0);
+    outb(channel->base + ATA_REGISTER_LBA_HIGH, 0);
+    outb(channel->base + ATA_REGISTER_COMMAND, ATA_IDENTIFY);
+
+    // A status of 0 (or a floating bus) means there is no drive
+    uint8 status = ata_delay(channel);
+    if(status == 0 || status == 0xFF){
+        return;
+    }
+    if(ata_wait_ready(channel) < 0){
+        return;
+    }
+
+    // ATAPI and SATA devices put their signature here instead of answering
+    if(inb(channel->base + ATA_REGISTER_LBA_MID) || inb(channel->base + ATA_REGISTER_LBA_HIGH)){
+        return;
+    }
+
+    for(int i = 0; i < ATA_POLL_LIMIT; i++){
+        status = inb(channel->control);
+        if(status & (ATA_STATUS_DRQ | ATA_STATUS_ERR)) break;
+    }
+    if(!(status & ATA_STATUS_DRQ) || (status & ATA_STATUS_ERR)){
+        return;
+    }
+
+    insw(channel->base + ATA_REGISTER_DATA, identify, 256);
+
+    info->present = 1;
+    info->lba48 = (identify[83] & (1 << 10)) != 0;
+    info->dma = (identify[49] & (1 << 8)) && channel->busMaster != 0;
+
+    // Words 100-103 hold the LBA48 sector count, words 60-61 the LBA28 one
+    if(info->lba48 && (identify[102] || identify[103])){
+        info->sectorCount = 0xFFFFFFFF;
+    }
+    else if(info->lba48){
+        info->sectorCount = identify[100] | ((uint32) identify[101] << 16);
+    }
+    else{
+        info->sectorCount = identify[60] | ((uint32) identify[61] << 16);
+    }
+
+    // The model name is stored with the bytes of every word swapped, and padded with spaces
+    for(int i = 0; i < 20; i++){
+        info->model[i * 2] = identify[27 + i] >> 8;
+        info->model[i * 2 + 1] = identify[27 + i] & 0xFF;
+    }
+    int length = 40;
+    while(length > 0 && info->model[length - 1] == ' '){
+        length--;
+    }
+    info->model[length] = 0;
+}
+
+// How the block device layer reaches our drives
+static const blkdev_ops_t ata_blkdev_ops = {ata_read, ata_write, 0, 0, 0, 0};
+
+void ata_install(){
+    ata_find_bus_master();
+
+    for(int c = 0; c < 2; c++){
+        // Make sure the drives are allowed to interrupt (nIEN clear)
+        outb(ata_channels[c].control, 0);
+        irq_install_handler(ata_channels[c].irq, ata_irq_handler);
+    }
+
+    for(int drive = 0; drive < ATA_MAX_DRIVES; drive++){
+        ata_identify(drive);
+        if(!ata_drives[drive].present) continue;
+
+        // Known as hd0 - hd3 to the block device layer, there are no heads to keep track of
+        blkdev_t device;
+        stringcopy("hd0", device.name, 4);
+        device.name[2] += drive;
+        device.unit = drive;
+        device.ops = &ata_blkdev_ops;
+        device.sectorCount = ata_drives[drive].sectorCount;
+        device.sectorsPerTrack = 0;
+        device.heads = 0;
+        blkdev_register(&device);
+    }
+}
+
+// Copy what we know about a drive into info, returns -1 if there is no drive
+int ata_get_info(int drive, ata_drive_info_t *info){
+    if(drive < 0 || drive >= ATA_MAX_DRIVES || !ata_drives[drive].present){
+        return -1;
+    }
+
+    *info = ata_drives[drive];
+    return 0;
+}
+
+void ata_print_drives(){
+    for(int drive = 0; drive < ATA_MAX_DRIVES; drive++){
+        ata_drive_info_t *info = &ata_drives[drive];
+        if(!info->present) continue;
+
+        printf(" - ATA drive ");
+        printint(drive);
+        printf(": ");
+        printf(info->model);
+        printf(", ");
+        printint(info->sectorCount / 2048);
+        printf(" MB");
+        if(info->lba48) printf(", LBA48");
+        if(info->dma) printf(", DMA");
+        putchar('\n');
+    }
+}
+
+
+// ATA Commands
+
+/*
+ * Select the drive and load the registers for a command on sectors [lba, lba + sectors)
+ * LBA48 writes every register twice, high bytes first
+ */
+void ata_setup_command(int drive, uint32 lba, uint32 sectors, int lba48){
+    ata_channel_t *channel = &ata_channels[drive / 2];
+
+    if(lba48){
+        outb(channel->base + ATA_REGISTER_DRIVE_SELECT, 0x40 | ((drive & 1) << 4));
+        ata_delay(channel);
+        outb(channel->base + ATA_REGISTER_SECTOR_COUNT, sectors >> 8);
+        outb(channel->base + ATA_REGISTER_LBA_LOW, lba >> 24);
+        outb(channel->base + ATA_REGISTER_LBA_MID, 0);
+        outb(channel->base + ATA_REGISTER_LBA_HIGH, 0);
+    }
+    else{
+        outb(channel->base + ATA_REGISTER_DRIVE_SELECT, 0xE0 | ((drive & 1) << 4) | ((lba >> 24) & 0x0F));
+        ata_delay(channel);
+    }
+
+    // A count of 0 means 256 sectors (65536 with LBA48)
+    outb(channel->base + ATA_REGISTER_SECTOR_COUNT, sectors & 0xFF);
+    outb(channel->base + ATA_REGISTER_LBA_LOW, lba & 0xFF);
+    outb(channel->base + ATA_REGISTER_LBA_MID, (lba >> 8) & 0xFF);
+    outb(channel->base + ATA_REGISTER_LBA_HIGH, (lba >> 16) & 0xFF);
+}
+
+/*
+ * Describe the buffer to the bus master, one PRD entry per 64 KiB page it touches
+ * Returns -1 if the buffer can't be described (odd address, or too many pieces)
+ */
+int ata_build_prdt(ata_channel_t *channel, uint32 address, uint32 length){
+    int entry = 0;
+
+    if(address & 1){
+        return -1;
+    }
+
+    while(length > 0){
+        if(entry == ATA_PRD_ENTRIES){
+            return -1;
+        }
+
+        uint32 pieceLength = 0x10000 - (address & 0xFFFF);
+        if(pieceLength > length){
+            pieceLength = length;
+        }
+
+        channel->prdt[entry].address = address;
+        channel->prdt[entry].byteCount = pieceLength & 0xFFFF;
+        channel->prdt[entry].flags = 0;
+
+        address += pieceLength;
+        length -= pieceLength;
+        entry++;
+    }
+
+    channel->prdt[entry - 1].flags = 0x8000;
+    return 0;
+}
+
+/*
+ * https://wiki.osdev.org/ATA/ATAPI_using_DMA
+ * Moves sectors with the bus master, the calling process sleeps until the channel interrupts
+ */
+// The buffer has to be described in channel->prdt already, see ata_build_prdt()
+ata_error_t ata_transfer_dma(int drive, uint32 lba, uint32 sectors, int write, int lba48){
+    ata_channel_t *channel = &ata_channels[drive / 2];
+
+    // Stop the bus master, hand it the table, and clear the old error and interrupt bits
+    outb(channel->busMaster + BMIDE_COMMAND, 0);
+    outl(channel->busMaster + BMIDE_PRDT, (uint32) channel->prdt);
+    outb(channel->busMaster + BMIDE_STATUS, BMIDE_STATUS_ERROR | BMIDE_STATUS_IRQ);
+    outb(channel->busMaster + BMIDE_COMMAND, write ? 0 : BMIDE_READ);
+
+    if(ata_wait_ready(channel) < 0){
+        return ATA_ERROR_TIMEOUT;
+    }
+    ata_setup_command(drive, lba, sectors, lba48);
+
+    channel->irqReceived = 0;
+    if(write){
+        outb(channel->base + ATA_REGISTER_COMMAND, lba48 ? ATA_WRITE_DMA_EXT : ATA_WRITE_DMA);
+    }
+    else{
+        outb(channel->base + ATA_REGISTER_COMMAND, lba48 ? ATA_READ_DMA_EXT : ATA_READ_DMA);
+    }
+    outb(channel->busMaster + BMIDE_COMMAND, (write ? 0 : BMIDE_READ) | BMIDE_START);
+
+    // Other processes run while the data moves
+    ata_wait_irq(channel);
+
+    uint8 busMasterStatus = inb(channel->busMaster + BMIDE_STATUS);
+    outb(channel->busMaster + BMIDE_COMMAND, 0);
+    outb(channel->busMaster + BMIDE_STATUS, BMIDE_STATUS_ERROR | BMIDE_STATUS_IRQ);
+
+    ata_error_t error = ata_check_status(ata_wait_ready(channel));
+    if(error == ATA_OK && (busMasterStatus & BMIDE_STATUS_ERROR)){
+        error = ATA_ERROR_DMA;
+    }
+
+    return error;
+}
+
+/*
+ * https://wiki.osdev.org/ATA_PIO_Mode#28_bit_PIO
+ * Moves sectors through the data register, the drive interrupts once for every sector
+ */
+ata_error_t ata_transfer_pio(int drive, uint32 lba, uint8 *buffer, uint32 sectors, int write, int lba48){
+    ata_channel_t *channel = &ata_channels[drive / 2];
+
+    if(ata_wait_ready(channel) < 0){
+        return ATA_ERROR_TIMEOUT;
+    }
+    ata_setup_command(drive, lba, sectors, lba48);
+
+    channel->irqReceived = 0;
+    if(write){
+        outb(channel->base + ATA_REGISTER_COMMAND, lba48 ? ATA_WRITE_SECTORS_EXT : ATA_WRITE_SECTORS);
+    }
+    else{
+        outb(channel->base + ATA_REGISTER_COMMAND, lba48 ? ATA_READ_SECTORS_EXT : ATA_READ_SECTORS);
+    }
+    ata_delay(channel);
+
+    for(uint32 i = 0; i < sectors; i++){
+        uint8 *sector = buffer + i * ATA_SECTOR_SIZE;
+
+        if(write){
+            // The drive asks for the first sector without interrupting, and interrupts after every one we send
+            int status = ata_wait_ready(channel);
+            ata_error_t error = ata_check_status(status);
+            if(error != ATA_OK) return error;
+            if(!(status & ATA_STATUS_DRQ)) return ATA_ERROR_DEVICE;
+
+            channel->irqReceived = 0;
+            outsw(channel->base + ATA_REGISTER_DATA, sector, ATA_SECTOR_SIZE / 2);
+            ata_wait_irq(channel);
+        }
+        else{
+            // The drive interrupts when a sector is ready to be read
+            ata_wait_irq(channel);
+            channel->irqReceived = 0;
+
+            int status = ata_wait_ready(channel);
+            ata_error_t error = ata_check_status(status);
+            if(error != ATA_OK) return error;
+            if(!(status & ATA_STATUS_DRQ)) return ATA_ERROR_DEVICE;
+
+            insw(channel->base + ATA_REGISTER_DATA, sector, ATA_SECTOR_SIZE / 2);
+        }
+    }
+
+    return ata_check_status(ata_wait_ready(channel));
+}
+
+// Make sure everything we wrote left the drive's write cache
+ata_error_t ata_flush(int drive, int lba48){
+    ata_channel_t *channel = &ata_channels[drive / 2];
+
+    if(ata_wait_ready(channel) < 0){
+        return ATA_ERROR_TIMEOUT;
+    }
+    outb(channel->base + ATA_REGISTER_DRIVE_SELECT, 0xA0 | ((drive & 1) << 4));
+    ata_delay(channel);
+
+    channel->irqReceived = 0;
+    outb(channel->base + ATA_REGISTER_COMMAND, lba48 ? ATA_FLUSH_CACHE_EXT : ATA_FLUSH_CACHE);
+    ata_wait_irq(channel);
+
+    return ata_check_status(ata_wait_ready(channel));
+}
+
+/*
+ * Moves count bytes (a multiple of 512) between address and the drive, starting at lba
+ * Uses bus-master DMA when the drive and buffer allow it, PIO otherwise
+ */
+int ata_transfer(int drive, uint32 lba, void *address, uint32 count, int write){
+    if(drive < 0 || drive >= ATA_MAX_DRIVES || !ata_drives[drive].present){
+        return ATA_ERROR_NO_DRIVE;
+    }
+
+    ata_drive_info_t *info = &ata_drives[drive];
+    ata_channel_t *channel = &ata_channels[drive / 2];
+    uint32 sectors = count / ATA_SECTOR_SIZE;
+    uint8 *buffer = (uint8 *) address;
+
+    if(lba >= info->sectorCount || sectors > info->sectorCount - lba){
+        return ATA_ERROR_OUT_OF_RANGE;
+    }
+
+    while(sectors > 0){
+        uint32 chunk = sectors < ATA_MAX_SECTORS_PER_COMMAND ? sectors : ATA_MAX_SECTORS_PER_COMMAND;
+
+        // LBA28 addresses the first 2^28 sectors, past that we need the 48-bit commands
+        int lba48 = info->lba48 && lba + chunk > 0x0FFFFFFF;
+
+        ata_error_t error;
+        if(info->dma && ata_build_prdt(channel, (uint32) buffer, chunk * ATA_SECTOR_SIZE) == 0){
+            error = ata_transfer_dma(drive, lba, chunk, write, lba48);
+        }
+        else{
+            error = ata_transfer_pio(drive, lba, buffer, chunk, write, lba48);
+        }
+
+        if(error != ATA_OK){
+            printf(write ? "Error writing ATA drive!\n" : "Error reading ATA drive!\n");
+            return error;
+        }
+
+        lba += chunk;
+        buffer += chunk * ATA_SECTOR_SIZE;
+        sectors -= chunk;
+    }
+
+    if(write){
+        return ata_flush(drive, info->lba48);
+    }
+    return ATA_OK;
+}
+
+// Both return ATA_OK, or the ata_error_t that stopped the transfer
+int ata_read(int drive, uint32 lba, void *address, uint32 count){
+    if(drive < 0 || drive >= ATA_MAX_DRIVES) return ATA_ERROR_NO_DRIVE;
+
+    lock_acquire(&ata_channels[drive / 2].lock);
+    int result = ata_transfer(drive, lba, address, count, 0);
+    lock_release(&ata_channels[drive / 2].lock);
+    return result;
+}
+
+int ata_write(int drive, uint32 lba, void *address, uint32 count){
+    if(drive < 0 || drive >= ATA_MAX_DRIVES) return ATA_ERROR_NO_DRIVE;
+
+    lock_acquire(&ata_channels[drive / 2].lock);
+    int result = ata_transfer(drive, lba, address, count, 1);
+    lock_release(&ata_channels[drive / 2].lock);
+    return result;
+}
@@ -0,0 +1,308 @@
+#include "./types.h"
+#include "./io.h"
+#include "./blkdev.h"
+#include "./string.h"
+
+/*
+ * Block devices
+ *
+ * Drivers register their devices here with their geometry and a table of functions,
+ * everything above (the cache and the FAT code) only knows devices by the number blkdev_register() returned.
+ *
+ * blkdev_submit() takes a batch of requests, sorts them by LBA (and so by cylinder), merges transfers
+ * of adjacent sectors that are also adjacent in memory, and hands them to the driver in one sweep of
+ * the heads (C-SCAN): from the cylinder the heads are on up to the end of the disk, then from the start.
+ */
+
+static blkdev_t blkdev_devices[BLKDEV_MAX_DEVICES];
+static int blkdev_count = 0;
+
+// Add a device, returns the number it is known by from now on, or -1 if there is no room
+int blkdev_register(blkdev_t *device)
+{
+    if(blkdev_count == BLKDEV_MAX_DEVICES) return -1;
+
+    blkdev_devices[blkdev_count] = *device;
+    return blkdev_count++;
+}
+
+// Returns the number of the device with the given name, or -1 if there is none
+int blkdev_find(char *name)
+{
+    for(int i = 0; i < blkdev_count; i++)
+    {
+        int length = 0;
+        while(length < 8 && name[length]) length++;
+
+        if(stringcompare(blkdev_devices[i].name, name, length) && (length == 8 || blkdev_devices[i].name[length] == 0))
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Returns the device, or 0 if no device has that number
+blkdev_t *blkdev_get(int device)
+{
+    if(device < 0 || device >= blkdev_count) return 0;
+    return &blkdev_devices[device];
+}
+
+void blkdev_print_devices()
+{
+    for(int i = 0; i < blkdev_count; i++)
+    {
+        printf(" - ");
+        printf(blkdev_devices[i].name);
+        printf(": ");
+        printint(blkdev_devices[i].sectorCount);
+        printf(" sectors\n");
+    }
+}
+
+// The cylinder a sector is on, devices without tracks are one big cylinder
+int blkdev_cylinder(blkdev_t *device, uint32 lba)
+{
+    if(device->sectorsPerTrack == 0 || device->heads == 0) return 0;
+    return lba / (device->sectorsPerTrack * device->heads);
+}
+
+// Returns non-zero if the two requests touch the same sector
+int blkdev_overlaps(blkdev_request_t *a, blkdev_request_t *b)
+{
+    if(a->device != b->device) return 0;
+
+    uint32 aEnd = a->lba + (a->count + BLKDEV_SECTOR_SIZE - 1) / BLKDEV_SECTOR_SIZE;
+    uint32 bEnd = b->lba + (b->count + BLKDEV_SECTOR_SIZE - 1) / BLKDEV_SECTOR_SIZE;
+
+    return a->lba < bEnd && b->lba < aEnd;
+}
+
+// Sort the batch by device, then LBA (insertion sort, batches are short)
+void blkdev_sort(blkdev_request_t **batch, int count)
+{
+    for(int i = 1; i < count; i++)
+    {
+        blkdev_request_t *request = batch[i];
+        int j = i - 1;
+
+        while(j >= 0 && (batch[j]->device > request->device ||
+              (batch[j]->device == request->device && batch[j]->lba > request->lba)))
+        {
+            batch[j + 1] = batch[j];
+            j--;
+        }
+        batch[j + 1] = request;
+    }
+}
+
+// Returns non-zero if next continues request on disk and in memory, so both can be one transfer
+int blkdev_continues(blkdev_request_t *request, blkdev_request_t *next)
+{
+    return next->device == request->device && next->write == request->write &&
+           request->count % BLKDEV_SECTOR_SIZE == 0 &&
+           request->lba + request->count / BLKDEV_SECTOR_SIZE == next->lba &&
+           request->address + request->count == next->address;
+}
+
+// Hand batch[first..last] (already merged into one run) to the driver and complete the requests
+int blkdev_dispatch(blkdev_request_t **batch, int first, int last)
+{
+    blkdev_request_t *request = batch[first];
+    blkdev_t *device = &blkdev_devices[request->device];
+
+    uint32 count = 0;
+    for(int i = first; i <= last; i++)
+    {
+        count += batch[i]->count;
+    }
+
+    int status;
+    if(request->write)
+    {
+        status = device->ops->write(device->unit, request->lba, request->address, count);
+    }
+    else
+    {
+        status = device->ops->read(device->unit, request->lba, request->address, count);
+    }
+
+    for(int i = first; i <= last; i++)
+    {
+        batch[i]->status = status;
+        if(batch[i]->complete) batch[i]->complete(batch[i]);
+    }
+
+    return status;
+}
+
+// Dispatch batch[from..to] in order, merging runs as we go, returns the first error (0 if none)
+int blkdev_sweep(blkdev_request_t **batch, int from, int to)
+{
+    int error = 0;
+
+    for(int index = from; index <= to; index++)
+    {
+        int runEnd = index;
+        while(runEnd < to && blkdev_continues(batch[runEnd], batch[runEnd + 1]))
+        {
+            runEnd++;
+        }
+
+        int result = blkdev_dispatch(batch, index, runEnd);
+        if(result && !error) error = result;
+
+        index = runEnd;
+    }
+
+    return error;
+}
+
+// Run one batch of requests that don't overlap, returns the first error (0 if none)
+int blkdev_run(blkdev_request_t **batch, int count)
+{
+    blkdev_sort(batch, count);
+
+    int error = 0;
+    int first = 0;
+
+    // Every device gets its own sweep
+    while(first < count)
+    {
+        blkdev_t *device = &blkdev_devices[batch[first]->device];
+        int last = first;
+        while(last + 1 < count && batch[last + 1]->device == batch[first]->device)
+        {
+            last++;
+        }
+
+        // Start with the first request at or past the cylinder the heads are on
+        int headCylinder = device->ops->cylinder ? device->ops->cylinder(device->unit) : 0;
+        int start = first;
+        while(start <= last && blkdev_cylinder(device, batch[start]->lba) < headCylinder)
+        {
+            start++;
+        }
+
+        // Sweep up to the end of the disk, then wrap around to the start
+        int result = blkdev_sweep(batch, start, last);
+        if(result && !error) error = result;
+        result = blkdev_sweep(batch, first, start - 1);
+        if(result && !error) error = result;
+
+        first = last + 1;
+    }
+
+    return error;
+}
+
+/*
+ * Run a batch of requests in the order that moves the heads the least
+ * Requests for the same sectors are run in the order they were given
+ * Returns the first error a driver reported (0 if none), every request also gets its own status
+ */
+int blkdev_submit(blkdev_request_t *requests, int count)
+{
+    blkdev_request_t *batch[BLKDEV_MAX_REQUESTS];
+    int batchCount = 0;
+    int error = 0;
+
+    for(int i = 0; i < count; i++)
+    {
+        blkdev_request_t *request = &requests[i];
+
+        if(!blkdev_get(request->device))
+        {
+            request->status = -1;
+            if(request->complete) request->complete(request);
+            if(!error) error = -1;
+            continue;
+        }
+
+        // Sorting would reorder two transfers of the same sector, so let the earlier one finish first
+        // A full batch is run the same way
+        int overlaps = batchCount == BLKDEV_MAX_REQUESTS;
+        for(int j = 0; j < batchCount && !overlaps; j++)
+        {
+            overlaps = blkdev_overlaps(batch[j], request);
+        }
+
+        if(overlaps)
+        {
+            int result = blkdev_run(batch, batchCount);
+            if(result && !error) error = result;
+            batchCount = 0;
+        }
+
+        batch[batchCount++] = request;
+    }
+
+    int result = blkdev_run(batch, batchCount);
+    if(result && !error) error = result;
+    return error;
+}
+
+// Add a request to a vector that is handed to blkdev_submit() later, a full vector is submitted first
+// error is set to the first error of such an early submit
+void blkdev_queue(blkdev_request_t *requests, int *count, blkdev_request_t *request, int *error)
+{
+    if(*count == BLKDEV_MAX_REQUESTS)
+    {
+        int result = blkdev_submit(requests, *count);
+        if(result && !*error) *error = result;
+        *count = 0;
+    }
+
+    requests[(*count)++] = *request;
+}
+
+// Ask the driver to push out anything it still holds back for the device
+int blkdev_flush(int device)
+{
+    blkdev_t *info = blkdev_get(device);
+    if(!info) return -1;
+    if(!info->ops->flush) return 0;
+
+    return info->ops->flush(info->unit);
+}
+
+// Tell the driver the shape of the medium in a device (from a file system's BPB)
+// Returns -1 if the device has a fixed geometry or can't take such a medium
+int blkdev_set_geometry(int device, uint32 sectorCount, uint16 sectorsPerTrack, uint16 heads)
+{
+    blkdev_t *info = blkdev_get(device);
+    if(!info || !info->ops->geometry) return -1;
+
+    int error = info->ops->geometry(info->unit, sectorCount, sectorsPerTrack, heads);
+    if(error) return error;
+
+    info->sectorCount = sectorCount;
+    info->sectorsPerTrack = sectorsPerTrack;
+    info->heads = heads;
+    return 0;
+}
+
+// Have the driver check every write on the medium before it completes
+// Returns whether it did so before, or -1 if the device can't verify writes
+int blkdev_set_write_verify(int device, int enabled)
+{
+    blkdev_t *info = blkdev_get(device);
+    if(!info || !info->ops->verify) return -1;
+
+    return info->ops->verify(info->unit, enabled);
+}
+
+// Read or write count bytes starting at lba right away
+int blkdev_read(int device, uint32 lba, void *address, uint32 count)
+{
+    blkdev_request_t request = {device, 0, lba, (uint8 *) address, count, 0, 0};
+    return blkdev_submit(&request, 1);
+}
+
+int blkdev_write(int device, uint32 lba, void *address, uint32 count)
+{
+    blkdev_request_t request = {device, 1, lba, (uint8 *) address, count, 0, 0};
+    return blkdev_submit(&request, 1);
+}
@@ -0,0 +1,478 @@
+#include "./types.h"
+#include "./io.h"
+#include "./blkdev.h"
+#include "./dma.h"
+#include "./cache.h"
+#include "./string.h"
+
+/*
+ * Sector buffer cache
+ *
+ * Sits between the FAT code and the block devices.
+ * Every buffer holds one 512 byte sector, identified by (device, LBA).
+ * Writes only go to the buffer and mark it dirty, cache_sync() writes dirty sectors back.
+ * When we run out of buffers the least recently used one is reused.
+ */
+
+typedef struct
+{
+    int device;
+    uint32 lba;
+    uint32 lastUsed;    // value of cache_clock when the sector was last touched
+    uint8 valid;
+    uint8 dirty;
+    uint8 prefetched;   // read ahead of time and not asked for yet
+    uint8 syncing;      // handed to the disk by cache_sync(), stays dirty until the write completes
+} cache_entry_t;
+
+static cache_entry_t cache_entries[CACHE_MAX_BUFFERS];
+static uint32 cache_buffer_count = 0;
+static uint32 cache_clock = 0;
+static cache_stats_t cache_stats;
+
+// Where the last read on each device stopped, a read starting there is sequential
+static uint32 cache_next_lba[CACHE_MAX_DEVICES];
+static uint32 cache_readahead_window = CACHE_DEFAULT_READAHEAD;
+
+uint8 *cache_buffer(int index)
+{
+    return (uint8 *) CACHE_BUFFER_ADDRESS + index * 512;
+}
+
+// Set up the cache with the given number of buffers (at most CACHE_MAX_BUFFERS)
+// Anything cached before is dropped, so sync first
+void cache_init(uint32 bufferCount)
+{
+    if(bufferCount > CACHE_MAX_BUFFERS) bufferCount = CACHE_MAX_BUFFERS;
+    if(bufferCount == 0) bufferCount = 1;
+
+    for(int i = 0; i < CACHE_MAX_BUFFERS; i++)
+    {
+        cache_entries[i].valid = 0;
+        cache_entries[i].dirty = 0;
+        cache_entries[i].prefetched = 0;
+        cache_entries[i].syncing = 0;
+    }
+
+    for(int i = 0; i < CACHE_MAX_DEVICES; i++)
+    {
+        cache_next_lba[i] = 0xFFFFFFFF;
+    }
+
+    cache_buffer_count = bufferCount;
+    cache_clock = 0;
+    cache_stats.hits = 0;
+    cache_stats.misses = 0;
+    cache_stats.writebacks = 0;
+    cache_stats.prefetched = 0;
+    cache_stats.prefetchHits = 0;
+}
+
+// Forget every sector of the device, dirty ones included
+// For when the medium changed behind our back (a new disk, a format)
+void cache_invalidate(int device)
+{
+    for(uint32 i = 0; i < cache_buffer_count; i++)
+    {
+        if(cache_entries[i].device == device)
+        {
+            cache_entries[i].valid = 0;
+            cache_entries[i].dirty = 0;
+            cache_entries[i].prefetched = 0;
+            cache_entries[i].syncing = 0;
+        }
+    }
+
+    if(device >= 0 && device < CACHE_MAX_DEVICES) cache_next_lba[device] = 0xFFFFFFFF;
+}
+
+// Returns the buffer index holding the sector, or -1 if it is not cached
+int cache_lookup(int device, uint32 lba)
+{
+    for(uint32 i = 0; i < cache_buffer_count; i++)
+    {
+        if(cache_entries[i].valid && cache_entries[i].lba == lba && cache_entries[i].device == device)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Find a buffer for a new sector: a free one if there is any, otherwise the least recently used
+// A dirty victim is written back before its buffer is handed out, if that fails it stays dirty
+// and the least recently used clean sector goes instead
+// Returns -1 if every buffer holds a dirty sector and the victim could not be written
+int cache_allocate(int device, uint32 lba)
+{
+    int victim = 0;
+
+    for(uint32 i = 0; i < cache_buffer_count; i++)
+    {
+        if(!cache_entries[i].valid)
+        {
+            victim = i;
+            break;
+        }
+
+        if(cache_entries[i].lastUsed < cache_entries[victim].lastUsed)
+        {
+            victim = i;
+        }
+    }
+
+    cache_entry_t *entry = &cache_entries[victim];
+    if(entry->valid && entry->dirty)
+    {
+        if(blkdev_write(entry->device, entry->lba, cache_buffer(victim), 512) == 0)
+        {
+            cache_stats.writebacks++;
+        }
+        else
+        {
+            victim = -1;
+            for(uint32 i = 0; i < cache_buffer_count; i++)
+            {
+                if(cache_entries[i].dirty) continue;
+
+                if(victim < 0 || cache_entries[i].lastUsed < cache_entries[victim].lastUsed)
+                {
+                    victim = i;
+                }
+            }
+
+            if(victim < 0) return -1;
+            entry = &cache_entries[victim];
+        }
+    }
+
+    entry->device = device;
+    entry->lba = lba;
+    entry->valid = 1;
+    entry->dirty = 0;
+    entry->prefetched = 0;
+    entry->syncing = 0;
+    return victim;
+}
+
+// How many sectors to read ahead of a sequential read ending at start:
+// the rest of the track start is on and the whole next track, limited by the configured window,
+// the end of the disk, sectors we already have, and what fits in one DMA buffer with the run itself
+uint32 cache_readahead_length(int device, uint32 start, uint32 runLength)
+{
+    blkdev_t *info = blkdev_get(device);
+    uint32 sectorsPerTrack = info->sectorsPerTrack;
+    uint32 length = cache_readahead_window;
+
+    // Devices without tracks just get the whole window
+    if(sectorsPerTrack > 0)
+    {
+        length = sectorsPerTrack - start % sectorsPerTrack + sectorsPerTrack;
+    }
+
+    if(length > cache_readahead_window) length = cache_readahead_window;
+    if(runLength >= CACHE_READAHEAD_MAX_TRANSFER) return 0;
+    if(runLength + length > CACHE_READAHEAD_MAX_TRANSFER) length = CACHE_READAHEAD_MAX_TRANSFER - runLength;
+    if(start >= info->sectorCount) return 0;
+    if(start + length > info->sectorCount) length = info->sectorCount - start;
+
+    for(uint32 i = 0; i < length; i++)
+    {
+        if(cache_lookup(device, start + i) >= 0) return i;
+    }
+
+    return length;
+}
+
+int cache_read_sectors(int device, uint32 lba, void *address, uint32 count, int readahead)
+{
+    uint8 *destination = (uint8 *) address;
+    uint32 sectors = count / 512;
+
+    if(!blkdev_get(device)) return -1;
+
+    // Runs of missing sectors are read in one batch, so the device can order them
+    blkdev_request_t requests[BLKDEV_MAX_REQUESTS];
+    int requestCount = 0;
+    int error = 0;
+
+    // A read that picks up where the last one on the device stopped is part of a sequential scan
+    int sequential = 0;
+    if(device >= 0 && device < CACHE_MAX_DEVICES)
+    {
+        sequential = readahead && lba == cache_next_lba[device];
+        cache_next_lba[device] = lba + sectors;
+    }
+
+    // When we read ahead, the last run of missing sectors and the sectors after the request
+    // are read together into one DMA buffer
+    uint8 *aheadBuffer = 0;
+    uint32 aheadStart = 0;      // first sector of the request that is in the buffer
+    uint32 aheadLength = 0;     // sectors in the buffer past the end of the request
+    uint32 aheadBytes = 0;
+
+    for(uint32 i = 0; i < sectors; i++)
+    {
+        int index = cache_lookup(device, lba + i);
+
+        if(index >= 0)
+        {
+            memorycopy(cache_buffer(index), destination + i * 512, 512);
+            cache_entries[index].lastUsed = ++cache_clock;
+            cache_stats.hits++;
+
+            if(cache_entries[index].prefetched)
+            {
+                cache_entries[index].prefetched = 0;
+                cache_stats.prefetchHits++;
+            }
+            continue;
+        }
+
+        // Extend the current run of missing sectors, or start a new one
+        cache_stats.misses++;
+        uint32 runLength = 1;
+        while(i + runLength < sectors && cache_lookup(device, lba + i + runLength) < 0)
+        {
+            runLength++;
+        }
+
+        uint32 ahead = 0;
+        if(sequential && i + runLength == sectors)
+        {
+            ahead = cache_readahead_length(device, lba + sectors, runLength);
+        }
+        if(ahead > 0)
+        {
+            aheadBuffer = dma_alloc((runLength + ahead) * 512);
+        }
+
+        blkdev_request_t request = {device, 0, lba + i, destination + i * 512, runLength * 512, 0, 0};
+        if(aheadBuffer)
+        {
+            aheadStart = i;
+            aheadLength = ahead;
+            aheadBytes = (runLength + ahead) * 512;
+            request.address = aheadBuffer;
+            request.count = aheadBytes;
+        }
+        blkdev_queue(requests, &requestCount, &request, &error);
+
+        cache_stats.misses += runLength - 1;
+        i += runLength - 1;
+    }
+
+    if(requestCount == 0 && !error) return 0;
+
+    int result = blkdev_submit(requests, requestCount);
+    if(result && !error) error = result;
+    if(error)
+    {
+        if(!aheadBuffer) return error;
+
+        // Reading ahead may have run into a bad or missing sector we were never asked for
+        dma_free(aheadBuffer, aheadBytes);
+        return cache_read_sectors(device, lba, address, count, 0);
+    }
+
+    // The tail of the request arrived in the read-ahead buffer
+    if(aheadBuffer)
+    {
+        memorycopy(aheadBuffer, destination + aheadStart * 512, (sectors - aheadStart) * 512);
+    }
+
+    // Keep a copy of everything we just read, as far as there are buffers to spare
+    for(uint32 i = 0; i < sectors; i++)
+    {
+        if(cache_lookup(device, lba + i) >= 0) continue;
+
+        int index = cache_allocate(device, lba + i);
+        if(index < 0) break;
+        memorycopy(destination + i * 512, cache_buffer(index), 512);
+        cache_entries[index].lastUsed = ++cache_clock;
+    }
+
+    // And of the sectors we read ahead, they count as prefetch hits once somebody asks for them
+    for(uint32 i = 0; i < aheadLength; i++)
+    {
+        uint32 sector = lba + sectors + i;
+        if(cache_lookup(device, sector) >= 0) continue;
+
+        int index = cache_allocate(device, sector);
+        if(index < 0) break;
+        memorycopy(aheadBuffer + (sectors - aheadStart + i) * 512, cache_buffer(index), 512);
+        cache_entries[index].lastUsed = ++cache_clock;
+        cache_entries[index].prefetched = 1;
+        cache_stats.prefetched++;
+    }
+
+    dma_free(aheadBuffer, aheadBytes);
+    return 0;
+}
+
+// Read count bytes (a multiple of 512) starting at lba into address
+// Cached sectors are copied from memory, runs of missing sectors are read from the disk in one go
+// Sequential reads also bring in the rest of the track and the next one (see cache_set_readahead())
+int cache_read(int device, uint32 lba, void *address, uint32 count)
+{
+    return cache_read_sectors(device, lba, address, count, cache_readahead_window > 0);
+}
+
+// Set the most sectors a sequential read may bring in ahead of time, 0 turns read-ahead off
+void cache_set_readahead(uint32 sectors)
+{
+    cache_readahead_window = sectors;
+}
+
+// Write count bytes (a multiple of 512) from address to the sectors starting at lba
+// The data only reaches the disk on cache_sync(), sectors whose content did not change stay clean
+// Returns -1 if there was no buffer to keep a sector in (see cache_allocate()), the sectors before it were written
+int cache_write(int device, uint32 lba, void *address, uint32 count)
+{
+    uint8 *source = (uint8 *) address;
+    uint32 sectors = count / 512;
+
+    for(uint32 i = 0; i < sectors; i++)
+    {
+        int index = cache_lookup(device, lba + i);
+
+        if(index >= 0 && stringcompare((char *) cache_buffer(index), (char *) source + i * 512, 512))
+        {
+            cache_entries[index].lastUsed = ++cache_clock;
+            continue;
+        }
+
+        if(index < 0) index = cache_allocate(device, lba + i);
+        if(index < 0) return -1;
+
+        memorycopy(source + i * 512, cache_buffer(index), 512);
+        cache_entries[index].dirty = 1;
+        cache_entries[index].syncing = 0;   // a write back in flight has the old content
+        cache_entries[index].prefetched = 0;
+        cache_entries[index].lastUsed = ++cache_clock;
+    }
+
+    return 0;
+}
+
+// Called when a write back of cache_sync() completes
+// The sectors are clean only if the write worked and they weren't written to again in the meantime
+// A failed write leaves them dirty, so the next sync tries again
+void cache_sync_complete(blkdev_request_t *request)
+{
+    for(uint32 i = 0; i < request->count / 512; i++)
+    {
+        int index = cache_lookup(request->device, request->lba + i);
+        if(index < 0 || !cache_entries[index].syncing) continue;
+
+        cache_entries[index].syncing = 0;
+        if(request->status == 0)
+        {
+            cache_entries[index].dirty = 0;
+            cache_stats.writebacks++;
+        }
+    }
+}
+
+// Write every dirty sector back to the disk
+// Dirty sectors are gathered in LBA order in the staging area, so consecutive ones go out as one transfer
+int cache_sync()
+{
+    uint8 *staging = (uint8 *) CACHE_STAGING_ADDRESS;
+    uint8 *runStart = staging;
+    int runDevice = -1;
+    uint32 runLba = 0;
+    uint32 runLength = 0;
+
+    blkdev_request_t requests[BLKDEV_MAX_REQUESTS];
+    int requestCount = 0;
+    int error = 0;
+
+    while(1)
+    {
+        // Find the dirty sector with the lowest (device, LBA)
+        int next = -1;
+        for(uint32 i = 0; i < cache_buffer_count; i++)
+        {
+            cache_entry_t *entry = &cache_entries[i];
+            if(!entry->valid || !entry->dirty || entry->syncing) continue;
+
+            if(next < 0 || entry->device < cache_entries[next].device ||
+               (entry->device == cache_entries[next].device && entry->lba < cache_entries[next].lba))
+            {
+                next = i;
+            }
+        }
+
+        if(next < 0) break;
+
+        cache_entry_t *entry = &cache_entries[next];
+
+        // A gap ends the current run
+        if(runLength > 0 && (entry->device != runDevice || entry->lba != runLba + runLength))
+        {
+            blkdev_request_t request = {runDevice, 1, runLba, runStart, runLength * 512, 0, cache_sync_complete};
+            blkdev_queue(requests, &requestCount, &request, &error);
+            runStart = staging;
+            runLength = 0;
+        }
+
+        if(runLength == 0)
+        {
+            runDevice = entry->device;
+            runLba = entry->lba;
+        }
+
+        memorycopy(cache_buffer(next), staging, 512);
+        staging += 512;
+        runLength++;
+
+        entry->syncing = 1;
+    }
+
+    if(runLength > 0)
+    {
+        blkdev_request_t request = {runDevice, 1, runLba, runStart, runLength * 512, 0, cache_sync_complete};
+        blkdev_queue(requests, &requestCount, &request, &error);
+    }
+
+    int result = blkdev_submit(requests, requestCount);
+    if(result && !error) error = result;
+
+    // Devices that keep their own copy (a RAM disk with write-back) pass it on now
+    for(int device = 0; blkdev_get(device); device++)
+    {
+        result = blkdev_flush(device);
+        if(result && !error) error = result;
+    }
+    return error;
+}
+
+void cache_get_stats(cache_stats_t *stats)
+{
+    *stats = cache_stats;
+}
+
+void cache_print_stats()
+{
+    printf("Cache: ");
+    printint(cache_stats.hits);
+    printf(" hits, ");
+    printint(cache_stats.misses);
+    printf(" misses, ");
+    printint(cache_stats.writebacks);
+    printf(" sectors written back\n");
+    printf(" - read ahead: ");
+    printint(cache_stats.prefetchHits);
+    printf(" of ");
+    printint(cache_stats.prefetched);
+    printf(" sectors used");
+    if(cache_stats.prefetched > 0)
+    {
+        printf(" (");
+        printint(cache_stats.prefetchHits * 100 / cache_stats.prefetched);
+        printf("%)");
+    }
+    putchar('\n');
+}
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include "./types.h"
 #include "./io.h"
+#include "./dma.h"
 
 #define low_16(address) (uint16)((address) & 0xFFFF)
 #define high_16(address) (uint16)(((address) >> 16) & 0xFFFF)
@@ -137,4 +138,65 @@ void prepare_for_floppyDMA_read(){
     // outb(ISA_DMA_REGISTER_SingleChannelMask, 0x02);
     maskChannel(2, 0);
 
+}
+
+
+/*
+ * ISA DMA buffers
+ *
+ * The DMA controller only sees a 24-bit address (below 16 MiB) and a 16-bit address counter,
+ * so a buffer must not cross a 64 KiB page. Buffers that break these rules are replaced by
+ * bounce buffers from the pool below for the duration of a transfer.
+ */
+
+// One byte per DMA_BLOCK_SIZE block of the pool, non-zero if it is handed out
+static uint8 dma_pool_used[DMA_POOL_SIZE / DMA_BLOCK_SIZE];
+
+// Returns non-zero if the DMA controller can transfer count bytes at address directly
+int dma_is_safe(uint32 address, uint32 count){
+    if(count == 0) return 1;
+
+    uint32 last = address + count - 1;
+    if(last >= 0x1000000) return 0;
+
+    return (address >> 16) == (last >> 16);
+}
+
+// Hand out a DMA-safe buffer of at least size bytes, or 0 if the pool is exhausted
+void *dma_alloc(uint32 size){
+    uint32 blocks = (size + DMA_BLOCK_SIZE - 1) / DMA_BLOCK_SIZE;
+    uint32 poolBlocks = DMA_POOL_SIZE / DMA_BLOCK_SIZE;
+
+    if(blocks == 0 || blocks > poolBlocks) return 0;
+
+    // First fit
+    for(uint32 first = 0; first + blocks <= poolBlocks; first++){
+        uint32 length = 0;
+        while(length < blocks && !dma_pool_used[first + length]){
+            length++;
+        }
+
+        if(length == blocks){
+            for(uint32 i = 0; i < blocks; i++){
+                dma_pool_used[first + i] = 1;
+            }
+            return (void *) (DMA_POOL_ADDRESS + first * DMA_BLOCK_SIZE);
+        }
+
+        first += length;
+    }
+
+    return 0;
+}
+
+// Give a buffer from dma_alloc() back to the pool
+void dma_free(void *address, uint32 size){
+    if(address == 0) return;
+
+    uint32 first = ((uint32) address - DMA_POOL_ADDRESS) / DMA_BLOCK_SIZE;
+    uint32 blocks = (size + DMA_BLOCK_SIZE - 1) / DMA_BLOCK_SIZE;
+
+    for(uint32 i = 0; i < blocks; i++){
+        dma_pool_used[first + i] = 0;
+    }
 }
\ No newline at end of file
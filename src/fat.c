@@ -1,181 +1,1177 @@
 #include "./fat.h"
-#include "./fdc.h"
+#include "./multitasking.h"
+#include "./cache.h"
+#include "./blkdev.h"
+#include "./ramdisk.h"
+#include "./dma.h"
+#include "./io.h"
 #include "./string.h"
 
 // FAT Copies
-// First copy is fat0 stored at 
-// Second copy is fat1
+// First copy is fat0 stored at 0x20000, the second copy fat1 follows it, both exactly as they are on the disk (packed FAT12)
 // There were issues declaring the FATs as non-pointers
 // When they would get read from floppy, it would overwrite wrong areas of memory
-fat_t *fat0;
-fat_t *fat1;
+uint8 *fat0;
+uint8 *fat1;
 void *startAddress = (void *) 0x20000;
 
+// Every entry of the FAT decoded to 16 bits, this is what chain walks read
+// setFATEntry() keeps it, and the packed copies, up to date
+uint16 *fatClusters = (uint16 *) FAT_INDEX_ADDRESS;
+uint32 fatEntryCount;               // entries that stand for a cluster on the disk (including the two reserved ones)
+uint16 fatDirtySectors;             // one bit per sector of the packed FAT that changed since writeFATs()
+
+// One bit per cluster, set if the cluster is free, built by init_fs() and kept up to date by setFATEntry()
+uint8 freeClusters[FAT_MAX_ENTRIES / 8];
+uint32 freeClusterCount;
+uint32 allocationCursor;            // where the next search for free clusters starts (next fit)
+
 directory_t currentDirectory;  // The current directory we have opened
 directory_entry_t rootDirectoryEntry;   // The root directory's directory entry (this does not exist on the disk since the root is not inside of another directory)
-file_t currentFile;            // The current file we have opened
+file_t *openFiles = (file_t *) FILE_TABLE_ADDRESS;  // Every file some process has open, see openFile()
+uint32 openFileSlots;               // slots of the table whose buffer fits in memory, set by init_fs()
+
+// Cleared while openFile() reads a slot's file in, a process opening the same file meanwhile waits on it (see wait_event())
+volatile int openFileLoaded[FILE_MAX_OPEN];
+
+// The process whose descriptors the file functions use
+extern proc_t *running;
+
+// Held by the process using the file system: the FATs, the directory, the open files and the cache
+// Every function fat.h declares takes it, the ...Locked() versions expect the caller to hold it
+sleeplock_t fileSystemLock = SLEEPLOCK_INIT;
+
+// Where everything is on the mounted device, worked out from its BIOS Parameter Block by init_fs()
+int fatDevice = -1;
+uint32 fatStartSector;              // first sector of the first FAT, the second one follows it
+uint32 sectorsPerFat;
+uint32 sectorsPerCluster;
+uint32 clusterSize;                 // in bytes
+uint32 rootDirectoryStartSector;
+uint32 rootDirectorySectors;
+uint32 dataStartSector;             // first sector of cluster 2
+
+// Set by setWriteVerify(), closeFile() then has the device check everything it writes
+int verifyWrites = 0;
+
+// The FATs and the root directory are loaded one after the other and must end below 0x30000
+#define FS_TABLES_MAX_SECTORS ((0x30000 - 0x20000) / 512)
+
+// One bit per sector of the root directory that changed since writeDirectory()
+uint8 directoryDirtySectors[FS_TABLES_MAX_SECTORS / 8];
+
+// A slot of the hash index over the root directory, the name and extension are kept packed so a lookup never
+// has to look at the directory itself
+typedef struct
+{
+    uint64 name;            // the 8 bytes of the name
+    uint32 ext;             // the 3 bytes of the extension
+    uint16 entry;           // the entry's index in the directory + 1, 0 if the slot was never used
+    uint16 unused;
+} directory_slot_t;
+
+// A slot whose entry was deleted, lookups have to probe past it
+#define DIRECTORY_SLOT_DELETED 0xFFFF
+
+// A name that was looked up and not found
+typedef struct
+{
+    uint64 name;
+    uint32 ext;
+    uint8 valid;
+} directory_miss_t;
+
+directory_slot_t *directoryIndex = (directory_slot_t *) DIRECTORY_INDEX_ADDRESS;
+directory_miss_t directoryMisses[DIRECTORY_MISS_CACHE_SIZE];
+uint32 directoryEntryCount;         // entries the root directory has room for
+
+// loadFileToDevice() moves files through a buffer of this many sectors
+#define LOAD_BUFFER_SECTORS 36
+
+// makeFileSystem() gives a new root directory as many entries as a 1.44MB floppy has (14 sectors)
+#define NEW_ROOT_DIRECTORY_ENTRIES 224
+
+// Returns the first sector a cluster is stored in
+uint32 clusterToSector(uint16 cluster)
+{
+    return dataStartSector + (cluster - 2) * sectorsPerCluster;
+}
+
+// Entry n of a packed FAT12
+// Entries pair up in three bytes, an even entry takes the first byte and the low half of the second,
+// an odd entry the high half of the second byte and the third byte
+uint16 fat12Get(uint8 *fat, uint32 n)
+{
+    uint32 offset = n + n / 2;
+    uint16 value = fat[offset] | (fat[offset + 1] << 8);
+
+    return (n & 1) ? value >> 4 : value & 0x0FFF;
+}
+
+void fat12Set(uint8 *fat, uint32 n, uint16 value)
+{
+    uint32 offset = n + n / 2;
+    value &= 0x0FFF;
+
+    if(n & 1)
+    {
+        fat[offset] = (fat[offset] & 0x0F) | (value << 4);
+        fat[offset + 1] = value >> 4;
+    }
+    else
+    {
+        fat[offset] = value;
+        fat[offset + 1] = (fat[offset + 1] & 0xF0) | (value >> 8);
+    }
+}
+
+// A packed entry as it is kept in fatClusters
+uint16 fat12Decode(uint16 value)
+{
+    return value >= 0x0FF8 ? FAT_END_OF_CHAIN : value;
+}
+
+// Change an entry in the decoded FAT and in both packed copies, the sectors it is packed into are written by writeFATs()
+void setFATEntry(uint16 cluster, uint16 value)
+{
+    if(cluster >= fatEntryCount) return;
+
+    if(fatClusters[cluster] == FAT_FREE && value != FAT_FREE)
+    {
+        freeClusters[cluster / 8] &= ~(1 << (cluster % 8));
+        freeClusterCount--;
+    }
+    else if(fatClusters[cluster] != FAT_FREE && value == FAT_FREE)
+    {
+        freeClusters[cluster / 8] |= 1 << (cluster % 8);
+        freeClusterCount++;
+    }
+
+    fatClusters[cluster] = value;
+
+    uint16 packed = value == FAT_END_OF_CHAIN ? 0x0FFF : value;
+    fat12Set(fat0, cluster, packed);
+    fat12Set(fat1, cluster, packed);
+
+    // An entry can straddle two sectors
+    uint32 offset = cluster + cluster / 2;
+    fatDirtySectors |= 1 << (offset / 512);
+    fatDirtySectors |= 1 << ((offset + 1) / 512);
+}
+
+// Hand the sectors of both FATs that changed to the cache, they reach the disk with the next cache_sync()
+void writeFATs()
+{
+    for(uint32 sector = 0; sector < sectorsPerFat; sector++)
+    {
+        if(!(fatDirtySectors & (1 << sector))) continue;
+
+        // A sector the cache could not take stays dirty, the next call hands it over again
+        if(cache_write(fatDevice, fatStartSector + sector, fat0 + sector * 512, 512) == 0 &&
+           cache_write(fatDevice, fatStartSector + sectorsPerFat + sector, fat1 + sector * 512, 512) == 0)
+        {
+            fatDirtySectors &= ~(1 << sector);
+        }
+    }
+}
+
+// Scrub null terminators from a filename and extension and pad them with spaces in place, the way they are in a directory entry
+void padFileName(char *filename, char *ext)
+{
+    char nullFound = 0;
+    for(int i = 1; i < 8; i++)
+    {
+        if (filename[i] == 0 && !nullFound) nullFound = 1;
+        if (nullFound) filename[i] = ' ';
+    }
+
+    nullFound = 0;
+    for(int i = 1; i < 3; i++)
+    {
+        if (ext[i] == 0 && !nullFound) nullFound = 1;
+        if (nullFound) ext[i] = ' ';
+    }
+}
+
+// The 8 bytes of a name as one 64 bit key, the 3 bytes of an extension as a 32 bit key
+uint64 packName(uint8 *name)
+{
+    uint64 key = 0;
+    for(int i = 7; i >= 0; i--)
+    {
+        key = (key << 8) | name[i];
+    }
+    return key;
+}
+
+uint32 packExt(uint8 *ext)
+{
+    return ext[0] | (ext[1] << 8) | (ext[2] << 16);
+}
+
+uint32 directoryHash(uint64 name, uint32 ext)
+{
+    uint32 hash = (uint32) name * 0x9E3779B1 ^ (uint32) (name >> 32) * 0x85EBCA6B ^ ext * 0xC2B2AE35;
+    return hash ^ (hash >> 16);
+}
+
+// Add entry (its index in the root directory) to the hash index
+// A name that was cached as missing is forgotten
+void indexDirectoryEntry(uint32 entry)
+{
+    directory_entry_t *directoryEntry = (directory_entry_t *) currentDirectory.startingAddress + entry;
+    uint64 name = packName(directoryEntry->filename);
+    uint32 ext = packExt(directoryEntry->ext);
+    uint32 hash = directoryHash(name, ext);
+
+    directory_miss_t *miss = &directoryMisses[hash & (DIRECTORY_MISS_CACHE_SIZE - 1)];
+    if(miss->valid && miss->name == name && miss->ext == ext) miss->valid = 0;
+
+    // Linear probing, the first empty or deleted slot takes it
+    uint32 slot = hash & (DIRECTORY_INDEX_SIZE - 1);
+    while(directoryIndex[slot].entry != 0 && directoryIndex[slot].entry != DIRECTORY_SLOT_DELETED)
+    {
+        slot = (slot + 1) & (DIRECTORY_INDEX_SIZE - 1);
+    }
+
+    directoryIndex[slot].name = name;
+    directoryIndex[slot].ext = ext;
+    directoryIndex[slot].entry = entry + 1;
+}
+
+// Returns the index in the root directory of the entry with this name and extension, or -1 if there is none
+int lookupDirectoryIndex(uint64 name, uint32 ext)
+{
+    uint32 hash = directoryHash(name, ext);
+
+    directory_miss_t *miss = &directoryMisses[hash & (DIRECTORY_MISS_CACHE_SIZE - 1)];
+    if(miss->valid && miss->name == name && miss->ext == ext) return -1;
+
+    uint32 slot = hash & (DIRECTORY_INDEX_SIZE - 1);
+    for(uint32 probes = 0; probes < DIRECTORY_INDEX_SIZE && directoryIndex[slot].entry != 0; probes++)
+    {
+        if(directoryIndex[slot].entry != DIRECTORY_SLOT_DELETED &&
+           directoryIndex[slot].name == name && directoryIndex[slot].ext == ext)
+        {
+            return directoryIndex[slot].entry - 1;
+        }
+
+        slot = (slot + 1) & (DIRECTORY_INDEX_SIZE - 1);
+    }
+
+    miss->name = name;
+    miss->ext = ext;
+    miss->valid = 1;
+    return -1;
+}
+
+// Take entry (its index in the root directory) out of the hash index, before the entry itself is cleared
+void unindexDirectoryEntry(uint32 entry)
+{
+    directory_entry_t *directoryEntry = (directory_entry_t *) currentDirectory.startingAddress + entry;
+    uint32 slot = directoryHash(packName(directoryEntry->filename), packExt(directoryEntry->ext)) & (DIRECTORY_INDEX_SIZE - 1);
+
+    for(uint32 probes = 0; probes < DIRECTORY_INDEX_SIZE && directoryIndex[slot].entry != 0; probes++)
+    {
+        if(directoryIndex[slot].entry == entry + 1)
+        {
+            directoryIndex[slot].entry = DIRECTORY_SLOT_DELETED;
+            return;
+        }
+
+        slot = (slot + 1) & (DIRECTORY_INDEX_SIZE - 1);
+    }
+}
+
+// Index every entry of the root directory that is in use
+// Entries after an end marker are indexed too, we used to clear deleted entries to zero
+void buildDirectoryIndex()
+{
+    for(uint32 slot = 0; slot < DIRECTORY_INDEX_SIZE; slot++)
+    {
+        directoryIndex[slot].entry = 0;
+    }
+
+    for(uint32 i = 0; i < DIRECTORY_MISS_CACHE_SIZE; i++)
+    {
+        directoryMisses[i].valid = 0;
+    }
+
+    directory_entry_t *directoryEntry = (directory_entry_t *) currentDirectory.startingAddress;
+    for(uint32 entry = 0; entry < directoryEntryCount; entry++)
+    {
+        uint8 first = directoryEntry[entry].filename[0];
+        if(first != DIRECTORY_ENTRY_END && first != DIRECTORY_ENTRY_DELETED)
+        {
+            indexDirectoryEntry(entry);
+        }
+    }
+}
+
+// Remember that the sector of the root directory holding an entry changed
+void markDirectoryEntryDirty(directory_entry_t *entry)
+{
+    uint32 sector = ((uint8 *) entry - currentDirectory.startingAddress) / 512;
+    if(sector < rootDirectorySectors)
+    {
+        directoryDirtySectors[sector / 8] |= 1 << (sector % 8);
+    }
+}
+
+// Hand the sectors of the root directory that changed to the cache, they reach the disk with the next cache_sync()
+void writeDirectory()
+{
+    for(uint32 sector = 0; sector < rootDirectorySectors; sector++)
+    {
+        if(!(directoryDirtySectors[sector / 8] & (1 << (sector % 8)))) continue;
+
+        if(cache_write(fatDevice, rootDirectoryStartSector + sector, currentDirectory.startingAddress + sector * 512, 512) == 0)
+        {
+            directoryDirtySectors[sector / 8] &= ~(1 << (sector % 8));
+        }
+    }
+}
+
+// Initialize the file system on a block device
+// Reads the boot sector to find the FATs and root directory, then loads them
+// Returns 0 on success, -1 if the device can't be read or holds a layout we don't support
+int init_fsLocked(int device)
+{
+    // The FATs and directory are loaded into 0x20000 one after the other (0x20000, 0x21200, and 0x22400 for a 1.44MB floppy)
+    // These addresses were chosen because they are far enough away from the kernel (0x10000 - 0x1FFFF)
+
+    cache_init(CACHE_DEFAULT_BUFFERS);
+
+    uint8 buffer[512];
+    if(!blkdev_get(device) || cache_read(device, 0, buffer, 512))
+    {
+        printf("Error: Could not read the boot sector!\n");
+        return -1;
+    }
+
+    // We keep clusters of one or two sectors and both FATs below 0x30000, anything else (or anything bigger than FAT12) can't be mounted
+    boot_sector_t *bootSector = (boot_sector_t *) buffer;
+    uint32 sectorCount = bootSector->sectorCount ? bootSector->sectorCount : bootSector->largeSectorCount;
+    uint32 tableSectors = bootSector->fatCount * bootSector->sectorsPerFat +
+                          (bootSector->rootDirectoryEntries * sizeof(directory_entry_t) + 511) / 512;
+    uint32 firstDataSector = bootSector->ReservedSectors + tableSectors;
+
+    if(bootSector->bytesPerSector != 512 || bootSector->sectorsPerCluster == 0 ||
+       bootSector->sectorsPerCluster > FAT_MAX_SECTORS_PER_CLUSTER || bootSector->fatCount != 2 ||
+       bootSector->sectorsPerFat == 0 || bootSector->sectorsPerFat > FAT_MAX_SECTORS ||
+       tableSectors > FS_TABLES_MAX_SECTORS || bootSector->rootDirectoryEntries > DIRECTORY_MAX_ENTRIES ||
+       sectorCount <= firstDataSector ||
+       (sectorCount - firstDataSector) / bootSector->sectorsPerCluster > FAT12_MAX_CLUSTERS)
+    {
+        printf("Error: The file system on this device is not supported!\n");
+        return -1;
+    }
+
+    // Drives with removable media only guessed the geometry, the BPB knows it (devices with a fixed geometry ignore this)
+    blkdev_set_geometry(device, sectorCount, bootSector->sectorsPerTrack, bootSector->headCount);
+
+    fatDevice = device;
+    fatStartSector = bootSector->ReservedSectors;
+    sectorsPerFat = bootSector->sectorsPerFat;
+    sectorsPerCluster = bootSector->sectorsPerCluster;
+    clusterSize = sectorsPerCluster * 512;
+    rootDirectoryStartSector = fatStartSector + bootSector->fatCount * sectorsPerFat;
+    rootDirectorySectors = (bootSector->rootDirectoryEntries * sizeof(directory_entry_t) + 511) / 512;
+    dataStartSector = rootDirectoryStartSector + rootDirectorySectors;
+    directoryEntryCount = bootSector->rootDirectoryEntries;
+
+    // The first copy of the FAT
+    fat0 = (uint8 *) startAddress; // Put FAT at 0x20000
+
+    // The second copy of the FAT
+    fat1 = fat0 + sectorsPerFat * 512; // Put FAT at 0x21200
+
+    // The root directory
+    currentDirectory.isOpened = 1;
+    currentDirectory.directoryEntry = &rootDirectoryEntry;
+
+    currentDirectory.startingAddress = fat1 + sectorsPerFat * 512; // Put ROOT at 0x22400
+    stringcopy("ROOT    ", (char *)currentDirectory.directoryEntry->filename, 8);
+
+    // The FATs and the root directory follow each other on disk and in memory, so read them in one go
+    if(cache_read(fatDevice, fatStartSector, startAddress, 512 * (2 * sectorsPerFat + rootDirectorySectors)))
+    {
+        printf("Error: Could not read the FATs and the root directory!\n");
+        fatDevice = -1;
+        return -1;
+    }
+
+    // Decode the entries of every cluster on the disk, the rest of the index reads as end of chain
+    fatEntryCount = (sectorCount - dataStartSector) / sectorsPerCluster + 2;
+    if(fatEntryCount > sectorsPerFat * 512 * 2 / 3) fatEntryCount = sectorsPerFat * 512 * 2 / 3;
+    for(uint32 cluster = 0; cluster < FAT_MAX_ENTRIES; cluster++)
+    {
+        fatClusters[cluster] = cluster < fatEntryCount ? fat12Decode(fat12Get(fat0, cluster)) : FAT_END_OF_CHAIN;
+    }
+    fatDirtySectors = 0;
+    for(uint32 i = 0; i < sizeof(directoryDirtySectors); i++)
+    {
+        directoryDirtySectors[i] = 0;
+    }
+
+    // Note down which clusters are free, so allocating one doesn't have to search the FAT
+    freeClusterCount = 0;
+    for(uint32 cluster = 0; cluster < FAT_MAX_ENTRIES; cluster++)
+    {
+        if(cluster >= 2 && cluster < fatEntryCount && fatClusters[cluster] == FAT_FREE)
+        {
+            freeClusters[cluster / 8] |= 1 << (cluster % 8);
+            freeClusterCount++;
+        }
+        else
+        {
+            freeClusters[cluster / 8] &= ~(1 << (cluster % 8));
+        }
+    }
+    allocationCursor = 2;
+
+    // Hash every name in the root directory, lookups don't scan it after this
+    buildDirectoryIndex();
+
+    // Open files are loaded above 16 MiB
+    if(a20_enable())
+    {
+        printf("Error: Could not enable the A20 line!\n");
+        fatDevice = -1;
+        return -1;
+    }
+
+    // Only hand out the slots whose buffer ends inside the memory there is
+    uint32 memoryEnd = memory_end();
+    openFileSlots = memoryEnd > FILE_BUFFER_ADDRESS ? (memoryEnd - FILE_BUFFER_ADDRESS) / FILE_BUFFER_SIZE : 0;
+    if(openFileSlots > FILE_MAX_OPEN) openFileSlots = FILE_MAX_OPEN;
+    if(openFileSlots == 0)
+    {
+        printf("Error: There is not enough memory above 16 MiB to open a file!\n");
+        fatDevice = -1;
+        return -1;
+    }
+
+    // Start with no files open
+    for(int i = 0; i < FILE_MAX_OPEN; i++)
+    {
+        openFiles[i].references = 0;
+        openFiles[i].directoryEntry = 0;
+        openFiles[i].startingAddress = 0;
+    }
+    return 0;
+}
+
+// Work out the layout of a new file system on a device of sectorCount sectors
+// Volumes with more sectors than FAT12 can number get clusters of two sectors (a 2.88MB floppy)
+// Returns 0, or -1 if the device is too small or too big for FAT12
+int fileSystemLayout(uint32 sectorCount, uint32 *clusterSectors, uint32 *fatSectors)
+{
+    uint32 rootSectors = NEW_ROOT_DIRECTORY_ENTRIES * sizeof(directory_entry_t) / 512;
+    *clusterSectors = sectorCount > FAT12_MAX_CLUSTERS ? 2 : 1;
+
+    // Each FAT needs 12 bits for every cluster left over once the FATs themselves are taken out
+    *fatSectors = 1;
+    uint32 clusters = 0;
+    while(1)
+    {
+        if(sectorCount <= 1 + rootSectors + 2 * *fatSectors + *clusterSectors) return -1;
+        clusters = (sectorCount - 1 - rootSectors - 2 * *fatSectors) / *clusterSectors;
+
+        uint32 needed = (((clusters + 2) * 3 + 1) / 2 + 511) / 512;
+        if(needed <= *fatSectors) break;
+        *fatSectors = needed;
+    }
+
+    // Anything bigger than this would have to be FAT16
+    if(clusters > FAT12_MAX_CLUSTERS || *fatSectors > FAT_MAX_SECTORS) return -1;
+    return 0;
+}
+
+// Check that makeFileSystem() can put a file system on a device, before anything (like a format) is done to it
+// Returns 0 if it can, -1 if the device is the mounted one, too small or too big
+int canMakeFileSystemLocked(int device)
+{
+    blkdev_t *info = blkdev_get(device);
+    uint32 clusterSectors;
+    uint32 fatSectors;
+
+    if(info == 0 || device == fatDevice)
+    {
+        printf("Error: Can't make a file system on this device!\n");
+        return -1;
+    }
+
+    if(fileSystemLayout(info->sectorCount, &clusterSectors, &fatSectors))
+    {
+        printf("Error: The device doesn't fit a FAT12 file system!\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Write an empty file system to a device: a boot sector with a BPB for its geometry, two empty FATs and an empty root directory
+// Together with floppy_format() this sets up a new disk, the boot sector has no boot code so the disk can't be booted
+// Returns 0 on success, -1 if the device is the mounted one, doesn't fit FAT12, or can't be written
+int makeFileSystemLocked(int device)
+{
+    if(canMakeFileSystemLocked(device)) return -1;
+
+    blkdev_t *info = blkdev_get(device);
+    uint32 rootSectors = NEW_ROOT_DIRECTORY_ENTRIES * sizeof(directory_entry_t) / 512;
+    uint32 clusterSectors;
+    uint32 fatSectors;
+    fileSystemLayout(info->sectorCount, &clusterSectors, &fatSectors);
+
+    uint32 sectors = 1 + 2 * fatSectors + rootSectors;
+
+    // The boot sector, FATs and root directory follow each other, so they are written in one go
+    uint8 *buffer = dma_alloc(sectors * 512);
+    if(buffer == 0) return -1;
+
+    for(uint32 i = 0; i < sectors * 512; i++)
+    {
+        buffer[i] = 0;
+    }
+
+    boot_sector_t *bootSector = (boot_sector_t *) buffer;
+
+    // Jump over the BPB to an int 0x18, which tells the BIOS to try the next boot device
+    bootSector->jumpInstruction[0] = 0xEB;
+    bootSector->jumpInstruction[1] = sizeof(boot_sector_t) - 2;
+    bootSector->jumpInstruction[2] = 0x90;
+    buffer[sizeof(boot_sector_t)] = 0xCD;
+    buffer[sizeof(boot_sector_t) + 1] = 0x18;
+
+    stringcopy("MSWIN4.1", (char *) bootSector->oem, 8);
+    bootSector->bytesPerSector = 512;
+    bootSector->sectorsPerCluster = clusterSectors;
+    bootSector->ReservedSectors = 1;
+    bootSector->fatCount = 2;
+    bootSector->rootDirectoryEntries = NEW_ROOT_DIRECTORY_ENTRIES;
+    bootSector->sectorCount = info->sectorCount < 0x10000 ? info->sectorCount : 0;
+    bootSector->largeSectorCount = info->sectorCount < 0x10000 ? 0 : info->sectorCount;
+    bootSector->mediaDescriptorType = info->sectorsPerTrack ? 0xF0 : 0xF8;   // removable or fixed
+    bootSector->sectorsPerFat = fatSectors;
+    bootSector->sectorsPerTrack = info->sectorsPerTrack;
+    bootSector->headCount = info->heads;
+
+    bootSector->signature = 0x29;
+    stringcopy("NO NAME    ", (char *) bootSector->volumeLabel, 11);
+    stringcopy("FAT12   ", (char *) bootSector->systemID, 8);
+
+    buffer[510] = 0x55;
+    buffer[511] = 0xAA;
+
+    // The first two entries of each FAT hold the media descriptor and an end of chain marker
+    for(uint32 copy = 0; copy < 2; copy++)
+    {
+        uint8 *fat = buffer + 512 * (1 + copy * fatSectors);
+        fat12Set(fat, 0, 0x0F00 | bootSector->mediaDescriptorType);
+        fat12Set(fat, 1, 0x0FFF);
+    }
+
+    // Whatever the cache still holds of the old contents is gone
+    cache_invalidate(device);
+    int error = blkdev_write(device, 0, buffer, sectors * 512);
+
+    dma_free(buffer, sectors * 512);
+    return error;
+}
+
+// Returns how many clusters, starting at the one given, follow each other on the disk
+// A run like this can be moved by the floppy driver in a single multi-sector command
+uint16 contiguousClusters(uint16 cluster)
+{
+    uint16 length = 1;
+    uint16 lastEntry = fatEntryCount - 1;
+
+    while(cluster < lastEntry && fatClusters[cluster] == cluster + 1)
+    {
+        cluster++;
+        length++;
+    }
+
+    return length;
+}
+
+int isClusterFree(uint32 cluster)
+{
+    return freeClusters[cluster / 8] & (1 << (cluster % 8));
+}
+
+// Finds the first run of up to count free clusters in [from, to), whole bytes without a free cluster are skipped
+// Returns where it starts and sets *length, or returns -1 if there is no free cluster in the range
+int findFreeRun(uint32 from, uint32 to, uint32 count, uint32 *length)
+{
+    uint32 cluster = from;
+
+    while(cluster < to)
+    {
+        if(cluster % 8 == 0 && freeClusters[cluster / 8] == 0)
+        {
+            cluster += 8;
+            continue;
+        }
+
+        if(isClusterFree(cluster))
+        {
+            uint32 runLength = 1;
+            while(runLength < count && cluster + runLength < to && isClusterFree(cluster + runLength))
+            {
+                runLength++;
+            }
+
+            *length = runLength;
+            return cluster;
+        }
+
+        cluster++;
+    }
+
+    return -1;
+}
+
+// Finds count free clusters next to each other if there are any, otherwise the longest run there is
+// The search starts at hint and wraps around to cluster 2
+// Returns the first cluster of the run and sets *length (at most count), or -1 if the disk is full
+int findFreeClusters(uint32 hint, uint32 count, uint32 *length)
+{
+    if(freeClusterCount == 0 || count == 0) return -1;
+    if(hint < 2 || hint >= fatEntryCount) hint = 2;
+
+    int best = -1;
+    *length = 0;
+
+    // Up to the end of the disk, then from the start up to the hint
+    for(int pass = 0; pass < 2; pass++)
+    {
+        uint32 cluster = pass == 0 ? hint : 2;
+        uint32 end = pass == 0 ? fatEntryCount : hint;
+
+        while(cluster < end)
+        {
+            uint32 runLength;
+            int run = findFreeRun(cluster, end, count, &runLength);
+            if(run < 0) break;
+
+            if(runLength > *length)
+            {
+                best = run;
+                *length = runLength;
+                if(runLength == count) return best;
+            }
+
+            cluster = run + runLength;
+        }
+    }
+
+    return best;
+}
+
+/*
+ * Allocate count clusters as one chain, as few runs of neighbouring clusters as the free space allows
+ * The chain is linked on after previous (or starts a new one if previous is 0), and the search starts right after it,
+ * so a growing file stays contiguous, otherwise it goes on from where the last allocation ended
+ * Returns the first new cluster, or -1 (and changes nothing) if there aren't enough free clusters
+ */
+int allocateClusters(uint16 previous, uint32 count)
+{
+    if(count == 0 || count > freeClusterCount) return -1;
+
+    int first = -1;
+    uint32 hint = previous ? previous + 1u : allocationCursor;
+
+    while(count > 0)
+    {
+        uint32 runLength;
+        int run = findFreeClusters(hint, count, &runLength);
+
+        // Link the run in, its clusters point to each other and the last one ends the chain
+        if(previous) setFATEntry(previous, run);
+        for(uint32 i = 0; i < runLength - 1; i++)
+        {
+            setFATEntry(run + i, run + i + 1);
+        }
+        setFATEntry(run + runLength - 1, FAT_END_OF_CHAIN);
+
+        if(first < 0) first = run;
+        previous = run + runLength - 1;
+        hint = previous + 1;
+        count -= runLength;
+    }
+
+    allocationCursor = hint;
+    return first;
+}
+
+// Free every cluster of a chain, the chain must already be cut off from whatever pointed at it
+void freeChain(uint16 cluster)
+{
+    for(uint32 i = 0; i < fatEntryCount && cluster >= 2 && cluster < fatEntryCount; i++)
+    {
+        uint16 next = fatClusters[cluster];
+        setFATEntry(cluster, FAT_FREE);
+        cluster = next;
+    }
+}
+
+// Add clusters start .. start + length - 1 to the end of a file's extents, merged into the last extent if they follow it
+// Returns -1 if the file would have too many extents
+int appendExtent(file_t *file, uint16 start, uint32 length)
+{
+    file_extent_t *last = file->extentCount ? &file->extents[file->extentCount - 1] : 0;
+
+    if(last && last->startCluster + last->length == start && last->length + length <= 0xFFFF)
+    {
+        last->length += length;
+    }
+    else
+    {
+        if(file->extentCount == FILE_MAX_EXTENTS) return -1;
+
+        file_extent_t *extent = &file->extents[file->extentCount++];
+        extent->fileCluster = file->clusterCount;
+        extent->startCluster = start;
+        extent->length = length;
+    }
+
+    file->clusterCount += length;
+    return 0;
+}
+
+/*
+ * Follow the chain from cluster to its end once and add it to the file's extents a run at a time
+ * The second FAT has to agree with the first on every entry of the chain
+ * A file without extents whose chain starts at cluster 0 is empty, other tools store zero-length files that way
+ * Returns 0, -1 if the FATs differ, -2 if the chain is longer than the disk (a loop), -4 if it is too fragmented
+ */
+int readExtents(file_t *file, uint16 cluster)
+{
+    if(cluster == 0 && file->extentCount == 0) return 0;
+
+    while(cluster != FAT_END_OF_CHAIN)
+    {
+        if(cluster < 2 || cluster >= fatEntryCount) return -2;
+
+        uint16 runLength = contiguousClusters(cluster);
+        for(uint16 i = 0; i < runLength; i++)
+        {
+            if(fatClusters[cluster + i] != fat12Decode(fat12Get(fat1, cluster + i))) return -1;
+        }
+
+        if(appendExtent(file, cluster, runLength)) return -4;
+
+        // No file on a volume we mount is longer than FILE_MAX_CLUSTERS, a longer chain loops (and wouldn't fit a file's buffer)
+        if(file->clusterCount > fatEntryCount || file->clusterCount > FILE_MAX_CLUSTERS) return -2;
+
+        cluster = fatClusters[cluster + runLength - 1];
+    }
+
+    return 0;
+}
 
-// Initialize the file system
-// Loads the FATs and root directory
-void init_fs()
+// Returns the extent holding a cluster of the file (counted from the start of the file), or 0 if the file is shorter
+file_extent_t *findExtent(file_t *file, uint32 fileCluster)
 {
-    // The FATs and directory are loaded into 0x20000, 0x21200, and 0x22400
-    // These addresses were chosen because they are far enough away from the kernel (0x01000 - 0x07000)
+    if(fileCluster >= file->clusterCount) return 0;
 
-    // Read the first copy of the FAT (Drive 0, Cluster 1, 512 bytes * 9 clusters)
-    fat0 = (fat_t *) startAddress; // Put FAT at 0x20000
-    floppy_read(0, 1,  (void *)fat0, sizeof(fat_t));
+    // Extents are in file order, so look for the last one starting at or before the cluster
+    uint32 low = 0;
+    uint32 high = file->extentCount - 1;
+    while(low < high)
+    {
+        uint32 middle = (low + high + 1) / 2;
+        if(file->extents[middle].fileCluster <= fileCluster)
+        {
+            low = middle;
+        }
+        else
+        {
+            high = middle - 1;
+        }
+    }
 
-    // Read the second copy of the FAT (Drive 0, Cluster 10, 512 bytes * 9 clusters)
-    fat1 = (fat_t *) (startAddress+sizeof(fat_t)); // Put FAT at 0x21200
-    floppy_read(0, 10, (void *)fat1, sizeof(fat_t));
+    return &file->extents[low];
+}
 
-    // Read the root directory (Drive 0, Cluster 19, 512 bytes * 14 clusters)
-    currentDirectory.isOpened = 1;
-    currentDirectory.directoryEntry = &rootDirectoryEntry;
+// Returns the sector a cluster of the file (counted from the start of the file) is stored in, or 0 if the file is shorter
+uint32 fileClusterToSector(file_t *file, uint32 fileCluster)
+{
+    file_extent_t *extent = findExtent(file, fileCluster);
+    if(extent == 0) return 0;
 
-    currentDirectory.startingAddress = (uint8 *) (startAddress+(sizeof(fat_t)*2)); // Put ROOT at 0x22400
-    stringcopy("ROOT    ", (char *)currentDirectory.directoryEntry->filename, 8);
+    return clusterToSector(extent->startCluster + (fileCluster - extent->fileCluster));
+}
+
+// Remember that a cluster of a file (counted from the start of the file) was written to
+void markClusterDirty(file_t *file, uint32 clusterIndex)
+{
+    if(clusterIndex < FILE_MAX_CLUSTERS)
+    {
+        file->dirtyClusters[clusterIndex / 8] |= 1 << (clusterIndex % 8);
+    }
+}
 
-    floppy_read(0, 19, (void *)currentDirectory.startingAddress, 512 * 14);
+int isClusterDirty(file_t *file, uint32 clusterIndex)
+{
+    return clusterIndex < FILE_MAX_CLUSTERS && (file->dirtyClusters[clusterIndex / 8] & (1 << (clusterIndex % 8)));
+}
 
-    // Start our file out blank
-    currentFile.isOpened = 0;
-    currentFile.directoryEntry = 0;
-    currentFile.index = 0;
-    currentFile.startingAddress = 0;
+// Returns the running process's descriptor fd, or 0 if fd is not a file it has open
+proc_file_t *getDescriptor(int fd)
+{
+    if(running == 0 || fd < 0 || fd >= MAX_PROC_FILES || running->files[fd].file < 0) return 0;
+    return &running->files[fd];
 }
 
-int findNextFATEntry() {
-     int index = 2;
+// Returns the open file behind the running process's descriptor fd, or 0 if fd is not open with all the bits of mode
+file_t *getOpenFile(int fd, int mode)
+{
+    proc_file_t *descriptor = getDescriptor(fd);
+    if(descriptor == 0 || (descriptor->mode & mode) != mode) return 0;
+    return &openFiles[descriptor->file];
+}
 
-    while(fat0->clusters[index] != 0x0000) {
-        index++; 
-    }
-    return index; 
+// Where a cluster of an open file (counted from the start of the file) is in its buffer
+// Only valid for clusters inside the file's window, see loadFileCluster()
+uint8 *fileClusterAddress(file_t *file, uint32 fileCluster)
+{
+    return file->startingAddress + (fileCluster - file->windowStart) * clusterSize;
 }
 
-int closeFile()
+int writeFileClusters(file_t *file);
+
+// Make sure the cluster holding byte index of an open file is in its buffer, and return where the byte is
+// Only lazily loaded files have to read anything: a cluster outside their window moves the window to start at it,
+// the clusters that changed in the old window go to the cache first
+// Clusters the file doesn't have on the disk yet (it is growing) start out as zeros
+// Returns 0, FILE_ERROR_NO_SPACE if the file could not be grown to make room for the move,
+// or FILE_ERROR_IO if the cluster could not be read (it is tried again the next time it is touched)
+int loadFileCluster(file_t *file, uint32 index, uint8 **address)
 {
+    uint32 fileCluster = index / clusterSize;
 
-if(!currentFile.isOpened) {
-    return -1;
+    if(!file->lazy)
+    {
+        *address = file->startingAddress + index;
+        return 0;
+    }
+
+    if(fileCluster < file->windowStart || fileCluster >= file->windowStart + FILE_WINDOW_CLUSTERS)
+    {
+        if(writeFileClusters(file)) return FILE_ERROR_NO_SPACE;
+
+        file->windowStart = fileCluster;
+        file->windowLoaded = 0;
+    }
+
+    uint32 bit = 1 << (fileCluster - file->windowStart);
+    if(!(file->windowLoaded & bit))
+    {
+        uint8 *cluster = fileClusterAddress(file, fileCluster);
+        if(fileCluster < file->clusterCount)
+        {
+            if(cache_read(fatDevice, fileClusterToSector(file, fileCluster), cluster, clusterSize)) return FILE_ERROR_IO;
+        }
+        else
+        {
+            memoryset(cluster, 0, clusterSize);
+        }
+        file->windowLoaded |= bit;
+    }
+
+    *address = fileClusterAddress(file, fileCluster) + index % clusterSize;
+    return 0;
+}
+
+// Turn on to have closeFile() only succeed once the device has checked the sectors it wrote
+// Devices that can't verify writes (anything but a floppy drive) ignore this
+void setWriteVerify(int enabled)
+{
+    verifyWrites = enabled;
 }
 
-//file.index shows the point where the file is at check if it is check if it greater than file size
+// Writes the clusters of an open file that changed since it was last synced, growing it on the disk first if it got bigger
+// Clusters that are next to each other in the file and on the disk go out in a single write
+// An empty file without clusters gets its first one here, the directory entry is pointed at it
+// The clusters only go to the cache, the FATs and the directory entry stay in memory
+// Returns -1 if the file could not be grown to its size or the cache had no room for its clusters
+int writeFileClusters(file_t *file)
+{
+    // The file needs a cluster for every clusterSize bytes it has grown to
+    uint32 clustersNeeded = (file->directoryEntry->fileSize + clusterSize - 1) / clusterSize;
+
+    // Chain on as many free clusters as the file grew by, right after its last cluster if they are free
+    // The last extent already says where the chain ends, the new clusters are added as extents as they come
+    if(file->clusterCount < clustersNeeded) {
+        file_extent_t *last = file->extentCount ? &file->extents[file->extentCount - 1] : 0;
+        uint16 lastCluster = last ? last->startCluster + last->length - 1 : 0;
+        int cluster = allocateClusters(lastCluster, clustersNeeded - file->clusterCount);
+
+        if(cluster < 0) {
+            printf("Error: The file could not be grown!\n");
+            return -1;
+        }
+
+        // The extents may have taken part of the new chain before they ran out, put them back the way they were,
+        // then cut the new clusters off the file again and free them
+        uint32 extentCount = file->extentCount;
+        uint32 clusterCount = file->clusterCount;
+        uint16 lastLength = last ? last->length : 0;
+
+        if(readExtents(file, cluster)) {
+            file->extentCount = extentCount;
+            file->clusterCount = clusterCount;
+            if(last) {
+                last->length = lastLength;
+                setFATEntry(lastCluster, FAT_END_OF_CHAIN);
+            }
+            freeChain(cluster);
+
+            printf("Error: The file could not be grown!\n");
+            return -1;
+        }
+
+        if(!last) {
+            file->directoryEntry->startingCluster = cluster;
+            markDirectoryEntryDirty(file->directoryEntry);
+        }
+    }
 
-    if(currentFile.index > currentFile.directoryEntry->fileSize){
-        currentFile.directoryEntry->fileSize += 512; // increase file size 
+    uint32 i = 0;
+
+    // Write back one run of dirty clusters at a time, as far as it stays inside an extent, clean clusters are skipped
+    while(i < clustersNeeded) {
+        if(!isClusterDirty(file, i)) {
+            i++;
+            continue;
+        }
 
-        int lastFATEntry = currentFile.directoryEntry->startingCluster;
+        file_extent_t *extent = findExtent(file, i);
+        uint32 extentEnd = extent->fileCluster + extent->length;
 
-        //Find end of cluster for file from FAT 
-        while(fat0->clusters[lastFATEntry] != 0xffff) {
-            lastFATEntry = fat0->clusters[lastFATEntry];
+        uint32 runLength = 1;
+        while(i + runLength < clustersNeeded && i + runLength < extentEnd && isClusterDirty(file, i + runLength)) {
+            runLength++;
         }
-        
-        // Next available spot on FAT 
-        int nextAvailableFATEntry = findNextFATEntry();
 
+        // The clusters stay dirty, the next sync tries them again
+        if(cache_write(fatDevice, fileClusterToSector(file, i), fileClusterAddress(file, i), runLength * clusterSize))
+        {
+            printf("Error: The file could not be written back!\n");
+            return -1;
+        }
+        i += runLength;
+    }
 
-        fat0->clusters[lastFATEntry] = nextAvailableFATEntry;
-        fat0->clusters[nextAvailableFATEntry] = 0xffff;
-        fat1->clusters[lastFATEntry] = nextAvailableFATEntry;
-        fat1->clusters[nextAvailableFATEntry] = 0xffff;
+    // Everything written is now in the cache, the next sync only writes what changes after this
+    for(uint32 i = 0; i < sizeof(file->dirtyClusters); i++) {
+        file->dirtyClusters[i] = 0;
     }
 
-    int fileClusterSize = currentFile.directoryEntry->fileSize / 512;  
-    int cluster = currentFile.directoryEntry->startingCluster;
+    return 0;
+}
 
-    for(int i = 0; i < fileClusterSize; i++) {
-        floppy_write(0, cluster + 31, (void *) currentFile.startingAddress + (i * 512), 512);
-        cluster = fat0->clusters[cluster];
+// Writes an open file back to the disk: the clusters that changed since it was last synced, the FATs and its directory entry
+int syncFile(file_t *file)
+{
+    // Anything the cache writes from here on is checked by the driver, a sector that fails is written again
+    int wasVerifying = -1;
+    if(verifyWrites) {
+        wasVerifying = blkdev_set_write_verify(fatDevice, 1);
     }
 
-    currentFile.isOpened = 0;
-    floppy_write(0, 1, (void *)fat0, sizeof(fat_t));
-    floppy_write(0, 10, (void *)fat1, sizeof(fat_t));
-    floppy_write(0, 19, (void *)currentDirectory.startingAddress, 512);
-    
+    if(writeFileClusters(file)) {
+        if(wasVerifying >= 0) {
+            blkdev_set_write_verify(fatDevice, wasVerifying);
+        }
+        return -1;
+    }
+
+    // Only the FAT sectors that changed (the file grew or was truncated) are written, the directory entry when its size changed
+    if(file->directoryEntry->fileSize != file->openedSize) {
+        markDirectoryEntryDirty(file->directoryEntry);
+        file->openedSize = file->directoryEntry->fileSize;
+    }
+    writeFATs();
+    writeDirectory();
 
+    // Write the data and metadata that changed in a single sweep of the heads
+    int error = cache_sync();
+
+    if(wasVerifying >= 0) {
+        blkdev_set_write_verify(fatDevice, wasVerifying);
+    }
+
+    // The driver has already said what went wrong
+    if(error) {
+        return -1;
+    }
 
     return 0;
 }
 
-int createFile(char *filename, char *ext)
+// Close one of the running process's descriptors, a descriptor opened for writing first syncs the file to the disk
+// The file stays in memory as long as other descriptors still have it open
+// Returns -1 if fd is not open or the sync failed (the descriptor is closed either way)
+int closeFileLocked(int fd)
 {
+    proc_file_t *descriptor = getDescriptor(fd);
+    if(descriptor == 0) {
+        return -1;
+    }
 
-    file_t newFile;
-
-    uint8 *newEntryPositionPointer = currentDirectory.startingAddress; // need address to point to where the dir entry for the new file is going to be
+    file_t *file = &openFiles[descriptor->file];
 
-    while(*newEntryPositionPointer != 0x00) {
-        newEntryPositionPointer += 32;
+    int error = 0;
+    if(descriptor->mode & FILE_MODE_WRITE) {
+        error = syncFile(file);
     }
 
-    newFile.directoryEntry = (directory_entry_t *) newEntryPositionPointer;
+    descriptor->file = -1;
+    file->references--;
 
-    stringcopy(filename, (char*) newFile.directoryEntry->filename, 8);
-    stringcopy(ext, (char*) newFile.directoryEntry->ext, 3);
+    return error;
+}
 
-    int index = 2;
+// Close every descriptor the running process still has open, exit() does this for processes that didn't
+void closeProcessFilesLocked()
+{
+    for(int fd = 0; fd < MAX_PROC_FILES; fd++) {
+        if(getDescriptor(fd)) {
+            closeFileLocked(fd);
+        }
+    }
+}
 
-    while(fat0->clusters[index] != 0x0000) {
-        index++; 
+// Cut an open file down to size bytes, the clusters past its new end are freed right away
+// The FATs and the directory entry reach the disk when a descriptor opened for writing is closed
+// Returns -1 if fd is not open for writing or the file is shorter than size
+int truncateFileLocked(int fd, uint32 size)
+{
+    file_t *file = getOpenFile(fd, FILE_MODE_WRITE);
+    if(file == 0 || size > file->directoryEntry->fileSize) {
+        return -1;
     }
 
-    fat0->clusters[index] = 0xffff;
-    fat1->clusters[index] = 0xffff;
+    // A file keeps at least one cluster
+    uint32 keep = (size + clusterSize - 1) / clusterSize;
+    if(keep == 0) keep = 1;
 
-    newFile.directoryEntry->fileSize = 512;
-    newFile.directoryEntry->startingCluster = index;
-    
-    currentFile.isOpened = 0;
+    if(keep < file->clusterCount) {
+        file_extent_t *extent = findExtent(file, keep - 1);
+        uint32 extentIndex = extent - file->extents;
+        uint16 lastCluster = extent->startCluster + (keep - 1 - extent->fileCluster);
 
-    uint8 buffer[512] = {0};
-    floppy_write(0, index + 31, (void *)buffer, 512);
-    floppy_write(0, 1, (void *)fat0, sizeof(fat_t));
-    floppy_write(0, 10, (void *)fat1, sizeof(fat_t));
-    floppy_write(0, 19, (void *)currentDirectory.startingAddress, 512 * 14);
-    
+        // The rest of the extent the new end is in, then every extent after it
+        for(uint32 cluster = lastCluster + 1; cluster < (uint32) extent->startCluster + extent->length; cluster++) {
+            setFATEntry(cluster, FAT_FREE);
+        }
+        for(uint32 i = extentIndex + 1; i < file->extentCount; i++) {
+            file_extent_t *freed = &file->extents[i];
+            for(uint32 cluster = freed->startCluster; cluster < (uint32) freed->startCluster + freed->length; cluster++) {
+                setFATEntry(cluster, FAT_FREE);
+            }
+        }
+        setFATEntry(lastCluster, FAT_END_OF_CHAIN);
+
+        extent->length = lastCluster - extent->startCluster + 1;
+        file->extentCount = extentIndex + 1;
+        file->clusterCount = keep;
+    }
+
+    // Clusters past the end have nothing left to write back
+    for(uint32 i = keep; i < FILE_MAX_CLUSTERS; i++) {
+        file->dirtyClusters[i / 8] &= ~(1 << (i % 8));
+    }
+
+    // Other descriptors past the new end read nothing more, writing there grows the file again
+    file->directoryEntry->fileSize = size;
+    if(running->files[fd].offset > size) running->files[fd].offset = size;
     return 0;
 }
 
-int deleteFile()
+// Adds an empty file to the current directory, with one cluster of zeros, and writes it to the disk
+// Returns -1 if a file with that name already exists, the directory or the disk is full, or the write failed
+int createFileLocked(char *filename, char *ext)
 {
 
-    if(currentFile.isOpened == 0) {
+    file_t newFile;
+
+    padFileName(filename, ext);
+
+    // The hash index tells us right away if the name is taken
+    if(lookupDirectoryIndex(packName((uint8 *) filename), packExt((uint8 *) ext)) >= 0) {
+        printf("Error: A file with that name already exists!\n");
         return -1;
     }
 
-    int cluster = currentFile.directoryEntry->startingCluster;
+    // Any unused or deleted entry will do, searching from the start keeps the directory packed at the front
+    directory_entry_t *directoryEntry = (directory_entry_t *) currentDirectory.startingAddress;
+    uint32 entry = 0;
+    while(entry < directoryEntryCount && directoryEntry[entry].filename[0] != DIRECTORY_ENTRY_END &&
+          directoryEntry[entry].filename[0] != DIRECTORY_ENTRY_DELETED) {
+        entry++;
+    }
 
-    while(fat0->clusters[cluster] != 0xffff) {
-            int nextCluster = fat0->clusters[cluster];
-            fat0->clusters[cluster] = 0x0000;
-            fat1->clusters[cluster] = 0x0000;
-            cluster = nextCluster;
+    if(entry == directoryEntryCount) {
+        printf("Error: The directory is full!\n");
+        return -1;
     }
 
-    fat0->clusters[cluster] = 0x0000;
-    fat1->clusters[cluster] = 0x0000;
+    // The new file gets a cluster from wherever the last allocation left off
+    int index = allocateClusters(0, 1);
+    if(index < 0) {
+        printf("Error: There is no room left on the disk for the file!\n");
+        return -1;
+    }
 
-    directory_entry_t *directoryEntry = (directory_entry_t *)currentDirectory.startingAddress;
+    newFile.directoryEntry = &directoryEntry[entry];
 
-    int maxEntries = 512 / sizeof(directory_entry_t); 
-    int i = 0;
+    // A deleted entry still has the attributes and times of the file that had it
+    memoryset(newFile.directoryEntry, 0, sizeof(directory_entry_t));
 
+    stringcopy(filename, (char*) newFile.directoryEntry->filename, 8);
+    stringcopy(ext, (char*) newFile.directoryEntry->ext, 3);
 
-    while (i < maxEntries && !(stringcompare(directoryEntry->filename, currentFile.directoryEntry->filename, 8))) {
-    directoryEntry++;
-    i++;
-    }
+    newFile.directoryEntry->fileSize = 512;
+    newFile.directoryEntry->startingCluster = index;
+    markDirectoryEntryDirty(newFile.directoryEntry);
+    indexDirectoryEntry(entry);
+
+    // The new cluster, the FAT sector (in both copies) and the directory sector that changed
+    uint8 buffer[FAT_MAX_CLUSTER_SIZE] = {0};
+    int error = cache_write(fatDevice, clusterToSector(index), (void *)buffer, clusterSize);
+    writeFATs();
+    writeDirectory();
+    if(cache_sync()) error = -1;
+    
+    return error;
+}
 
+// Delete the file behind one of the running process's descriptors, and close the descriptor
+// Returns -1 if fd is not open for writing, or the file is still open through another descriptor
+int deleteFileLocked(int fd)
+{
+    file_t *file = getOpenFile(fd, FILE_MODE_WRITE);
+    if(file == 0 || file->references > 1) {
+        return -1;
+    }
 
-    if (i == maxEntries) {
-    return -2; // file not found in directory
+    // Free the file's clusters an extent at a time, there is no chain to follow
+    for(uint32 i = 0; i < file->extentCount; i++) {
+        file_extent_t *extent = &file->extents[i];
+        for(uint32 cluster = extent->startCluster; cluster < extent->startCluster + extent->length; cluster++) {
+            setFATEntry(cluster, FAT_FREE);
+        }
     }
 
+    // The open file already points at its entry, there is nothing to search for
+    directory_entry_t *directoryEntry = file->directoryEntry;
+    unindexDirectoryEntry(directoryEntry - (directory_entry_t *) currentDirectory.startingAddress);
+
     uint8 *bytePointer = (uint8 *) directoryEntry;
 
     for(int i = 0; i < 32; i++) {
@@ -183,188 +1179,492 @@ int deleteFile()
         bytePointer++;
     }
 
-    currentFile.isOpened = 0;
+    // Marked deleted rather than unused, so entries after it are still found by other implementations
+    directoryEntry->filename[0] = DIRECTORY_ENTRY_DELETED;
+    markDirectoryEntryDirty(directoryEntry);
 
-    floppy_write(0, 1, (void *)fat0, sizeof(fat_t));
-    floppy_write(0, 10, (void *)fat1, sizeof(fat_t));
-    floppy_write(0, 19, (void *)currentDirectory.startingAddress, 512 * 14);
+    running->files[fd].file = -1;
+    file->references = 0;
+
+    writeFATs();
+    writeDirectory();
+    cache_sync();
     
     return 0;
 }
 
-// Returns a byte from a file that is currently loaded into memory
-// This does NOT modify the floppy disk
-// This function requires the file to have been loaded into memory with floppy_read()
-uint8 readByte(uint32 index)
+// Copies length bytes of an open file starting at offset out of or into buffer (zeros are written if buffer is 0)
+// A lazily loaded file is copied a cluster at a time as they are read in, any other file in one go
+// The caller has checked that the span is inside the file (reading) or fits its buffer (writing)
+// Returns the bytes copied, or the error of loadFileCluster() if nothing could be copied
+int copyFileSpan(file_t *file, uint8 *buffer, uint32 length, uint32 offset, int write)
 {
-    // Are we trying to read from the end of a file?
-    if(index >= currentFile.directoryEntry->fileSize)
-    {
-        return -2;
-    }
+    uint32 done = 0;
 
-    // Check if the file is opened and is not a NULL pointer
-    if(currentFile.isOpened && currentFile.startingAddress != 0)
+    while(done < length)
     {
-        currentFile.index = index + 1;              // Point us to the next index
-        // Return the byte at the specified index
-        return currentFile.startingAddress[index];
+        uint32 index = offset + done;
+        uint8 *address;
+        int error = loadFileCluster(file, index, &address);
+        if(error)
+        {
+            return done ? (int) done : error;
+        }
+
+        uint32 span = file->lazy ? clusterSize - index % clusterSize : length - done;
+        if(span > length - done) span = length - done;
+
+        if(!write)
+        {
+            memorycopy(address, buffer + done, span);
+        }
+        else
+        {
+            if(buffer) memorycopy(buffer + done, address, span);
+            else memoryset(address, 0, span);
+
+            // closeFile() has to write these clusters back, a window move before that needs the new size to find them
+            for(uint32 cluster = index / clusterSize; cluster <= (index + span - 1) / clusterSize; cluster++)
+            {
+                markClusterDirty(file, cluster);
+            }
+            if(index + span > file->directoryEntry->fileSize) file->directoryEntry->fileSize = index + span;
+        }
+
+        done += span;
     }
 
-    // If the file was not opened, or was a NULL pointer, return error
-    printf("Error: File was not opened or pointed to NULL!\n");
-    return -1;
+    return done;
 }
 
-// Returns the next byte from a file that is currently loaded into memory
-uint8 readNextByte()
+// Reads up to length bytes of a file starting at offset into buffer, the descriptor's offset stays where it is
+// Returns the bytes read (0 at the end of the file), or FILE_ERROR_BAD_DESCRIPTOR if fd is not open for reading,
+// FILE_ERROR_IO or FILE_ERROR_NO_SPACE if a lazily loaded file could not read the clusters in
+int readFileAtLocked(int fd, void *buffer, uint32 length, uint32 offset)
 {
-    return readByte(currentFile.index);
+    file_t *file = getOpenFile(fd, FILE_MODE_READ);
+    if(file == 0) return FILE_ERROR_BAD_DESCRIPTOR;
+
+    // Nothing past the end of the file
+    uint32 size = file->directoryEntry->fileSize;
+    if(offset >= size) return 0;
+    if(length > size - offset) length = size - offset;
+
+    return copyFileSpan(file, (uint8 *) buffer, length, offset, 0);
 }
 
-// Writes a byte to the current file that is currently loaded into memory
-// This does NOT modify the floppy disk
-// To write this to the floppy disk, we have to call floppy_write()
-int writeByte(uint8 byte, uint32 index)
+// Writes length bytes of buffer to a file starting at offset, the descriptor's offset stays where it is
+// The file grows as needed, a gap between its old end and offset is filled with zeros
+// This does NOT modify the floppy disk, to write this to the floppy disk, we have to call closeFile()
+// Returns the bytes written, or FILE_ERROR_BAD_DESCRIPTOR, FILE_ERROR_TOO_BIG, FILE_ERROR_NO_SPACE or FILE_ERROR_IO
+int writeFileAtLocked(int fd, void *buffer, uint32 length, uint32 offset)
 {
-    // Check if the file is opened and is not a NULL pointer
-    if(currentFile.isOpened && currentFile.startingAddress != 0)
+    file_t *file = getOpenFile(fd, FILE_MODE_WRITE);
+    if(file == 0) return FILE_ERROR_BAD_DESCRIPTOR;
+
+    if(offset > FILE_BUFFER_SIZE || length > FILE_BUFFER_SIZE - offset) return FILE_ERROR_TOO_BIG;
+
+    // A short fill is carried on, so a failure comes back as its error
+    uint32 size = file->directoryEntry->fileSize;
+    while(offset > size)
     {
-        currentFile.startingAddress[index] = byte;  // Place the byte at the address + index
-        if(index + 1 > currentFile.directoryEntry->fileSize) currentFile.directoryEntry->fileSize = index + 1;    // Increase the file size
-        currentFile.index = index + 1;              // Point us to the next index
-        return 0;
+        int filled = copyFileSpan(file, 0, offset - size, size, 1);
+        if(filled < 0) return filled;
+        size += filled;
     }
 
-    // If the file was not opened, or was a NULL pointer, return error
-    printf("Error: File was not opened or pointed to NULL!\n");
-    return -1;
+    return copyFileSpan(file, (uint8 *) buffer, length, offset, 1);
+}
+
+// Reads up to length bytes of a file into buffer from the descriptor's offset, and moves the offset past them
+int readFileLocked(int fd, void *buffer, uint32 length)
+{
+    proc_file_t *descriptor = getDescriptor(fd);
+    if(descriptor == 0) return FILE_ERROR_BAD_DESCRIPTOR;
+
+    int count = readFileAtLocked(fd, buffer, length, descriptor->offset);
+    if(count > 0) descriptor->offset += count;
+    return count;
 }
 
-// Writes a byte to the current file that is currently loaded into memory at the next index
-int writeNextByte(uint8 byte)
+// Writes length bytes of buffer to a file at the descriptor's offset, and moves the offset past them
+int writeFileLocked(int fd, void *buffer, uint32 length)
 {
-    return writeByte(byte, currentFile.index);
+    proc_file_t *descriptor = getDescriptor(fd);
+    if(descriptor == 0) return FILE_ERROR_BAD_DESCRIPTOR;
+
+    int count = writeFileAtLocked(fd, buffer, length, descriptor->offset);
+    if(count > 0) descriptor->offset += count;
+    return count;
+}
+
+// Moves the descriptor's offset to offset bytes from the start of the file, the current offset or the end of the file (whence)
+// Moving past the end is allowed, the next write fills the gap with zeros
+// Returns the new offset, or FILE_ERROR_BAD_DESCRIPTOR or FILE_ERROR_INVALID
+int seekFileLocked(int fd, int offset, int whence)
+{
+    proc_file_t *descriptor = getDescriptor(fd);
+    if(descriptor == 0) return FILE_ERROR_BAD_DESCRIPTOR;
+
+    int base;
+    if(whence == FILE_SEEK_SET) base = 0;
+    else if(whence == FILE_SEEK_CURRENT) base = descriptor->offset;
+    else if(whence == FILE_SEEK_END) base = openFiles[descriptor->file].directoryEntry->fileSize;
+    else return FILE_ERROR_INVALID;
+
+    if(base + offset < 0 || base + offset > FILE_BUFFER_SIZE) return FILE_ERROR_INVALID;
+
+    descriptor->offset = base + offset;
+    return descriptor->offset;
+}
+
+// Finds a file in the current directory, returns its directory entry or 0 if there is none
+// The filename and extension are padded with spaces in place
+directory_entry_t *findDirectoryEntry(char *filename, char *ext)
+{
+    padFileName(filename, ext);
+
+    int entry = lookupDirectoryIndex(packName((uint8 *) filename), packExt((uint8 *) ext));
+    if(entry < 0) return 0;
+
+    return (directory_entry_t *) currentDirectory.startingAddress + entry;
 }
 
-// Writes a byte to the current file that is currently loaded into memory at the next index multiple times
-int writeBytes(uint8 byte, uint32 count)
+// Returns 1 if the current directory has a file with this name, 0 if not
+// Only the hash index is looked at, the directory itself is not touched
+int fileExistsLocked(char *filename, char *ext)
 {
-    for(int i = 0; i < (int)count; i++)
+    padFileName(filename, ext);
+    return lookupDirectoryIndex(packName((uint8 *) filename), packExt((uint8 *) ext)) >= 0;
+}
+
+// Copies the contents of a file in the current directory to the start of a block device
+// Used to fill a RAM disk with a disk image stored as a file, the file is read a run of clusters at a time
+// Returns 0 on success, -3 if the file was not found, other error codes if something went wrong
+int loadFileToDeviceLocked(char *filename, char *ext, int device)
+{
+    directory_entry_t *directoryEntry = findDirectoryEntry(filename, ext);
+    if(directoryEntry == 0) return -3;
+
+    blkdev_t *target = blkdev_get(device);
+    uint32 sectors = (directoryEntry->fileSize + 511) / 512;
+    if(target == 0 || sectors > target->sectorCount) return -1;
+
+    // Runs of clusters go through a DMA buffer, they don't need to stay in the cache
+    uint8 *buffer = dma_alloc(LOAD_BUFFER_SECTORS * 512);
+    if(buffer == 0) return -1;
+
+    uint16 cluster = directoryEntry->startingCluster;
+    uint32 sector = 0;
+    int error = 0;
+
+    while(sector < sectors && cluster != 0xFFFF && !error)
     {
-        int error = writeByte(byte, currentFile.index);
+        uint32 runLength = contiguousClusters(cluster);
+        if(runLength > LOAD_BUFFER_SECTORS / sectorsPerCluster) runLength = LOAD_BUFFER_SECTORS / sectorsPerCluster;
+
+        // The last cluster may hold fewer sectors of the file than it has
+        uint32 runSectors = runLength * sectorsPerCluster;
+        if(runSectors > sectors - sector) runSectors = sectors - sector;
 
-        if (error != 0) return error;
+        error = blkdev_read(fatDevice, clusterToSector(cluster), buffer, runSectors * 512);
+        if(!error) error = blkdev_write(device, sector, buffer, runSectors * 512);
+
+        sector += runSectors;
+        cluster = fatClusters[cluster + runLength - 1];
     }
 
-    return 0;
+    dma_free(buffer, LOAD_BUFFER_SECTORS * 512);
+    return error;
 }
 
-// Finds a file within our current directory and loads every sector of the file into memory
-// Returns 0 if the file was found in the current directory
+// Finds a file within our current directory and gives the running process a descriptor for it
+// mode is FILE_MODE_READ, FILE_MODE_WRITE or both, every descriptor has its own mode and offset
+// A file that is already open (by any process) is shared, otherwise every sector of it is loaded into memory
+// With FILE_MODE_LAZY only its clusters are looked up, they are read as reads and writes touch them
+// Returns the descriptor (0 or more) if the file was found in the current directory
 // Returns -3 if the file was not found in the current directory
+// Returns -5 if the process or the system has too many files open
 // Returns other error codes if something went wrong
-int openFile(char *filename, char *ext)
+int openFileLocked(char *filename, char *ext, int mode)
 {
-	// If a file is open, stop!
-    if(currentFile.isOpened)
+    if(running == 0 || !(mode & FILE_MODE_READ_WRITE) || (mode & ~(FILE_MODE_READ_WRITE | FILE_MODE_LAZY)))
     {
-        printf("A file is already open! Please close this file before opening another!\n");
-        return 0;
+        return -1;
     }
-	
-    // Scrub null terminators from our filename and extension and pad with spaces for more accurate comparisons
-    char nullFound = 0;
-    for(int i = 1; i < 8; i++)
+
+    // The process needs a free descriptor
+    int fd = 0;
+    while(fd < MAX_PROC_FILES && running->files[fd].file >= 0)
     {
-        if (filename[i] == 0 && !nullFound) nullFound = 1;
-        if (nullFound) filename[i] = ' ';
+        fd++;
     }
 
-    nullFound = 0;
-    for(int i = 1; i < 3; i++)
+    if(fd == MAX_PROC_FILES)
     {
-        if (ext[i] == 0 && !nullFound) nullFound = 1;
-        if (nullFound) ext[i] = ' ';
+        printf("Error: Too many files open!\n");
+        return -5;
     }
 
-    // Get a pointer to the first address of the directory entry in this directory
-	directory_entry_t *directoryEntry = (directory_entry_t *)currentDirectory.startingAddress;
-    uint32 maxDirectoryEntryCount = 16;
-    char fileExists = 0;
-
-    // Assume we can have a maximum of 16 directory entries per directory
-    // Check each one to see if our filename and extension match
-    // This should actually be checking if the first byte of the directory entry is null
-	for(uint32 index = 0; index < maxDirectoryEntryCount; index++)
-	{
-        // Check if this entry has the same file name and extension
-		fileExists = stringcompare((char *)directoryEntry->filename, filename, 8) && stringcompare((char *)directoryEntry->ext, ext, 3);
-		
-        // If we found the file we can stop looping!
-		if(fileExists) break;
-
-		directoryEntry++;
-	}
+	directory_entry_t *directoryEntry = findDirectoryEntry(filename, ext);
+    char fileExists = directoryEntry != 0;
 
     // If the file exists, let's open it
     if(fileExists)
     {
-        // Check if the file has been corrupted
-        // Check each entry in the FAT table, ensure both FATs are consistent before opening the file
-        uint16 cluster = directoryEntry->startingCluster;
-        while(cluster != 0xFFFF)
+        // Share the file if it is already open, otherwise take a free slot of the table
+        int slot;
+        file_t *file;
+        while(1)
         {
-            // Check if the copies of the FATs are consistent
-            if(fat0->clusters[cluster] != fat1->clusters[cluster])
+            slot = -1;
+            for(uint32 i = 0; i < openFileSlots; i++)
             {
-                printf("Error: The file was found BUT the FAT table entries for this file differ!\n");
-                return -1;
+                if(openFiles[i].references && openFiles[i].directoryEntry == directoryEntry)
+                {
+                    slot = i;
+                    break;
+                }
+                if(!openFiles[i].references && slot < 0) slot = i;
             }
 
-            // Get the next cluster
-            cluster = fat0->clusters[cluster];
+            if(slot < 0)
+            {
+                printf("Error: Too many files open!\n");
+                return -5;
+            }
+
+            file = &openFiles[slot];
+            if(!file->references || openFileLoaded[slot]) break;
+
+            // Another process is still reading the file in, let it finish and look again, its load may have failed
+            // wait_event() clears the flag, set it again so every other process waiting on it wakes up too
+            lock_release(&fileSystemLock);
+            wait_event(&openFileLoaded[slot]);
+            openFileLoaded[slot] = 1;
+            lock_acquire(&fileSystemLock);
+        }
+
+        if(file->references)
+        {
+            file->references++;
+            running->files[fd].file = slot;
+            running->files[fd].offset = 0;
+            running->files[fd].mode = mode;
+            return fd;
+        }
+
+        // Walk the chain once and keep it as extents, checking that both FATs agree on every entry of it
+        file->extentCount = 0;
+        file->clusterCount = 0;
+        int error = readExtents(file, directoryEntry->startingCluster);
+
+        if(error == -1)
+        {
+            printf("Error: The file was found BUT the FAT table entries for this file differ!\n");
+            return -1;
+        }
+        // It is possible to get stuck in an infinite loop, reading FAT entries forever
+        // readExtents() prevents that by checking if the amount of sectors could actually fit on disk
+        if(error == -2)
+        {
+            printf("Error: The file appears to be bigger than the entire disk!\n");
+            return -2;
+        }
+        if(error == -4)
+        {
+            printf("Error: The file is too fragmented to open!\n");
+            return -4;
         }
 
-        // Set the starting address of the file to some memory location
-        uint8 *startingAddress = (void *)0x30000;
+        // Every slot of the table has its own buffer
+        uint8 *startingAddress = (uint8 *) FILE_BUFFER_ADDRESS + slot * FILE_BUFFER_SIZE;
+
+        // Hold the slot while we read, already tagged with the file so another process opening it waits for us
+        // instead of loading a second copy into another slot
+        file->directoryEntry = directoryEntry;
+        file->references = 1;
+        openFileLoaded[slot] = 0;
 
-        // Starting at the first sector, each each sector from floppy into memory
-        cluster = directoryEntry->startingCluster;
-        uint16 sectorCount = 0;
+        // A lazily loaded file starts with an empty window at its first cluster
+        file->lazy = (mode & FILE_MODE_LAZY) != 0;
+        file->windowStart = 0;
+        file->windowLoaded = 0;
 
-        // Loop through every link in the FAT
-        while(cluster != 0xFFFF)
+        // Otherwise read the file an extent at a time, sectors we have seen before come straight from the cache
+        for(uint32 i = 0; i < file->extentCount && !file->lazy; i++)
         {
-            // Convert the cluster to a sector
-            uint32 sector = cluster + 31;
-            
-            // Read the sector from the floppy disk
-            floppy_read(0, sector, (void *) startingAddress + (512 * sectorCount), 512);
-            sectorCount++;
-
-            // Get the next cluster
-            cluster = fat0->clusters[cluster];
-
-            // It is possible to get stuck in an infinite loop, reading FAT entries forever
-            // We prevent that here by checking if the amount of sectors could actually fit on disk
-            if(sectorCount > 2880)
+            file_extent_t *extent = &file->extents[i];
+            if(cache_read(fatDevice, clusterToSector(extent->startCluster),
+                          (void *) startingAddress + (clusterSize * extent->fileCluster), clusterSize * extent->length))
+            {
+                // The driver has already said what went wrong, give the slot back and wake whoever waits for it
+                file->references = 0;
+                file->directoryEntry = 0;
+                openFileLoaded[slot] = 1;
+                return -1;
+            }
+
+            // A big file takes a while to read, give processes parked on the file system a turn between extents
+            // One opening this same file finds the slot tagged and waits until it is loaded
+            if(running->type == PROC_TYPE_USER && waiting_process_count() > 0)
             {
-                printf("Error: The file appears to be bigger than the entire floppy disk!\n");
-                return -2;
+                lock_release(&fileSystemLock);
+                yield();
+                lock_acquire(&fileSystemLock);
             }
         }
 
-        // If no error has occured, label the file as opened and point it to all the data we just read in
-        currentFile.directoryEntry = directoryEntry;
-        currentFile.startingAddress = startingAddress;
-        currentFile.index = 0;
-        currentFile.isOpened = 1;
-        return 0;
+        // If no error has occured, point the file to all the data we just read in and hand out the descriptor
+        file->startingAddress = startingAddress;
+        file->openedSize = directoryEntry->fileSize;
+
+        // Nothing has been written yet
+        for(uint32 i = 0; i < sizeof(file->dirtyClusters); i++)
+        {
+            file->dirtyClusters[i] = 0;
+        }
+
+        openFileLoaded[slot] = 1;
+
+        running->files[fd].file = slot;
+        running->files[fd].offset = 0;
+        running->files[fd].mode = mode;
+        return fd;
     }
 
     // If we did not find the file return -3
 	return -3;
 }
 
+// The functions fat.h declares, each holds the file system lock while the ...Locked() version runs
+// A process waiting for a disk keeps holding it, only openFile() lets go between the extents of a file it loads
+
+int init_fs(int device)
+{
+    lock_acquire(&fileSystemLock);
+    int result = init_fsLocked(device);
+    lock_release(&fileSystemLock);
+    return result;
+}
+
+int canMakeFileSystem(int device)
+{
+    lock_acquire(&fileSystemLock);
+    int result = canMakeFileSystemLocked(device);
+    lock_release(&fileSystemLock);
+    return result;
+}
+
+int makeFileSystem(int device)
+{
+    lock_acquire(&fileSystemLock);
+    int result = makeFileSystemLocked(device);
+    lock_release(&fileSystemLock);
+    return result;
+}
+
+int openFile(char *filename, char *ext, int mode)
+{
+    lock_acquire(&fileSystemLock);
+    int result = openFileLocked(filename, ext, mode);
+    lock_release(&fileSystemLock);
+    return result;
+}
+
+int closeFile(int fd)
+{
+    lock_acquire(&fileSystemLock);
+    int result = closeFileLocked(fd);
+    lock_release(&fileSystemLock);
+    return result;
+}
+
+void closeProcessFiles()
+{
+    lock_acquire(&fileSystemLock);
+    closeProcessFilesLocked();
+    lock_release(&fileSystemLock);
+}
+
+int truncateFile(int fd, uint32 size)
+{
+    lock_acquire(&fileSystemLock);
+    int result = truncateFileLocked(fd, size);
+    lock_release(&fileSystemLock);
+    return result;
+}
+
+int createFile(char *filename, char *ext)
+{
+    lock_acquire(&fileSystemLock);
+    int result = createFileLocked(filename, ext);
+    lock_release(&fileSystemLock);
+    return result;
+}
+
+int deleteFile(int fd)
+{
+    lock_acquire(&fileSystemLock);
+    int result = deleteFileLocked(fd);
+    lock_release(&fileSystemLock);
+    return result;
+}
+
+int readFile(int fd, void *buffer, uint32 length)
+{
+    lock_acquire(&fileSystemLock);
+    int result = readFileLocked(fd, buffer, length);
+    lock_release(&fileSystemLock);
+    return result;
+}
+
+int writeFile(int fd, void *buffer, uint32 length)
+{
+    lock_acquire(&fileSystemLock);
+    int result = writeFileLocked(fd, buffer, length);
+    lock_release(&fileSystemLock);
+    return result;
+}
+
+int readFileAt(int fd, void *buffer, uint32 length, uint32 offset)
+{
+    lock_acquire(&fileSystemLock);
+    int result = readFileAtLocked(fd, buffer, length, offset);
+    lock_release(&fileSystemLock);
+    return result;
+}
+
+int writeFileAt(int fd, void *buffer, uint32 length, uint32 offset)
+{
+    lock_acquire(&fileSystemLock);
+    int result = writeFileAtLocked(fd, buffer, length, offset);
+    lock_release(&fileSystemLock);
+    return result;
+}
+
+int seekFile(int fd, int offset, int whence)
+{
+    lock_acquire(&fileSystemLock);
+    int result = seekFileLocked(fd, offset, whence);
+    lock_release(&fileSystemLock);
+    return result;
+}
+
+int fileExists(char *filename, char *ext)
+{
+    lock_acquire(&fileSystemLock);
+    int result = fileExistsLocked(filename, ext);
+    lock_release(&fileSystemLock);
+    return result;
+}
+
+int loadFileToDevice(char *filename, char *ext, int device)
+{
+    lock_acquire(&fileSystemLock);
+    int result = loadFileToDeviceLocked(filename, ext, device);
+    lock_release(&fileSystemLock);
+    return result;
+}
+
 
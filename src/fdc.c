@@ -2,9 +2,20 @@
 #include "./io.h"
 #include "./dma.h"
 #include "./irq.h"
+#include "./multitasking.h"
+#include "./timer.h"
+#include "./fdc.h"
+#include "./string.h"
+#include "./blkdev.h"
 // standard IRQ number for floppy controllers
 static const int floppy_irq = 6;
 
+// Set by the IRQ6 handler once the controller has finished a command
+static volatile int floppy_irq_received = 0;
+
+// Held by whoever is using the controller, all drives share its registers, IRQ and DMA channel
+static sleeplock_t floppy_controller_lock = SLEEPLOCK_INIT;
+
 enum FloppyRegisters
 {
     FLOPPY_STATUS_REGISTER_A                = 0x3F0, // read-only
@@ -56,11 +67,115 @@ char * drive_types[8] = {
         "unknown type"
 };
 
+#define FLOPPY_SECTOR_SIZE          512
+
+/*
+ * Data rate   value   Drive Type
+ * 1Mbps        3       2.88M
+ * 500Kbps      0       1.44M, 1.2M
+ * 300Kbps      1       360K in a 1.2M drive
+ * 250Kbps      2       720K, 360K
+ */
 enum FLOPPYSpeeds{
     KB500 = 0,
+    KB300 = 1,
+    KB250 = 2,
     MB1 = 3
 };
 
+// The shape of a disk and how fast the controller has to talk to it
+typedef struct
+{
+    uint8 sectorsPerTrack;
+    uint8 heads;
+    uint8 cylinders;
+    uint8 dataRate;             // one of FLOPPYSpeeds
+} floppy_geometry_t;
+
+// The media each CMOS drive type takes (see drive_types), until the disk's BPB tells us otherwise
+static const floppy_geometry_t floppy_geometries[8] = {
+    {18, 2, 80, KB500},         // none, assume 1.44MB so a missing CMOS entry still boots
+    { 9, 2, 40, KB300},
+    {15, 2, 80, KB500},
+    { 9, 2, 80, KB250},
+    {18, 2, 80, KB500},
+    {36, 2, 80, MB1},
+    {18, 2, 80, KB500},
+    {18, 2, 80, KB500}
+};
+
+// How long a motor needs to get up to speed before we may read or write
+#define FLOPPY_SPINUP_MS            500
+
+// One turn of the disk at 300 RPM, and how long the heads take to settle after a step
+#define FLOPPY_ROTATION_MS          200
+#define FLOPPY_HEAD_SETTLE_MS       15
+
+// A failed transfer is tried this many times in total, waiting twice as long after every failure
+#define FLOPPY_MAX_ATTEMPTS         6
+#define FLOPPY_RETRY_BACKOFF_MS     10
+#define FLOPPY_RECALIBRATE_ATTEMPTS 2
+
+// Lifecycle of a drive motor
+typedef enum
+{
+    FLOPPY_MOTOR_OFF,
+    FLOPPY_MOTOR_SPINNING_UP,   // turned on, not up to speed before motorDeadline
+    FLOPPY_MOTOR_ON,            // up to speed and in use
+    FLOPPY_MOTOR_IDLE           // up to speed but unused, turned off at motorDeadline
+} floppy_motor_state_t;
+
+/*
+ * SPECIFY timings (SRT, HLT), from the fastest we try to the very safe values we used to always send
+ * At 500 Kbps the step rate is (16 - SRT) ms and the head load time is HLT * 2 ms
+ */
+#define FLOPPY_TIMING_LEVELS 5
+static const uint8 floppy_timings[FLOPPY_TIMING_LEVELS][2] = {
+    {12, 1},
+    {11, 2},
+    {10, 3},
+    { 9, 4},
+    { 8, 5}
+};
+
+// Transfers in a row that must go through on the first attempt before a drive tries the next faster timings
+// Every back-off doubles it (up to the maximum), so a drive that can't take them is tried less and less often
+#define FLOPPY_TIMING_RECOVER_RUN   64
+#define FLOPPY_TIMING_RECOVER_MAX   4096
+
+// Everything we keep track of per drive
+typedef struct
+{
+    floppy_motor_state_t motorState;
+    uint32 motorDeadline;
+    int cylinder;               // where the heads are, -1 if we don't know
+    int timingLevel;            // index into floppy_timings
+    int timingChanged;          // the controller needs a new SPECIFY before the next command
+    uint32 cleanRun;            // transfers in a row that needed no retry
+    uint32 cleanNeeded;         // how long cleanRun has to get before we speed up again
+    uint8 type;                 // CMOS drive type, index into drive_types
+    int writeVerify;            // have the controller check every write, see floppy_set_write_verify()
+    floppy_geometry_t geometry; // of the disk in the drive
+    floppy_stats_t stats;
+} floppy_drive_t;
+
+// Start every drive on the fastest timings and only slow down when it makes mistakes
+static int floppy_auto_tune = 1;
+
+// The drive the controller was last given a SPECIFY for, -1 after a reset
+static int floppy_specified_drive = -1;
+
+static floppy_drive_t floppy_drives[4];
+
+// The DOR is written from the timer interrupt too, so we keep our own copy instead of reading it back
+static volatile uint8 floppy_dor = 0x0C;
+
+// How long an idle motor keeps spinning before we turn it off
+static uint32 floppy_motor_idle_ticks = TIMER_MS_TO_TICKS(3000);
+
+// The drives the controller was last told to record perpendicularly (PERPENDICULAR MODE bits 2-5)
+static uint8 floppy_perpendicular = 0;
+
 
 //
 // The MSR byte: [read-only]
@@ -93,13 +208,6 @@ enum FLOPPYSpeeds{
 // NRST is "not reset" so controller is enabled when it's 1
 //
 
-/*
- * Data rate   value   Drive Type
- * 1Mbps        3       2.88M
- * 500Kbps      0       1.44M, 1.2M
- */
-
-
 /*
  * Floppy Util
  */
@@ -108,24 +216,59 @@ enum FLOPPYSpeeds{
 
 
 
-void lba_2_chs_f(int sectors_per_track, uint32 lba, uint16* cyl, uint16* head, uint16* sector);
-void lba_2_chs(uint32 lba, uint16* cyl, uint16* head, uint16* sector);
+void lba_2_chs_f(int sectors_per_track, int heads, uint32 lba, uint16* cyl, uint16* head, uint16* sector);
+void lba_2_chs(int drive, uint32 lba, uint16* cyl, uint16* head, uint16* sector);
+uint32 floppy_transfer_length(int drive, uint32 lba, uint32 address, uint32 count, int *bounce);
 void floppy_detect_drives();
-uint8 get_drive_type();
+uint8 get_drive_type(int drive);
 void floppy_write_cmd(char cmd);
 unsigned char floppy_read_data();
 
-void lba_2_chs_f(int sectors_per_track, uint32 lba, uint16* cyl, uint16* head, uint16* sector)
+void lba_2_chs_f(int sectors_per_track, int heads, uint32 lba, uint16* cyl, uint16* head, uint16* sector)
 {
-    *cyl    = lba / (2 * sectors_per_track);
-    *head   = ((lba % (2 * sectors_per_track)) / 18);
-    *sector = ((lba % (2 * sectors_per_track)) % sectors_per_track + 1);
+    *cyl    = lba / (heads * sectors_per_track);
+    *head   = ((lba % (heads * sectors_per_track)) / sectors_per_track);
+    *sector = ((lba % (heads * sectors_per_track)) % sectors_per_track + 1);
 
 }
 
-void lba_2_chs(uint32 lba, uint16* cyl, uint16* head, uint16* sector)
+// Converts an LBA to CHS for the disk in the drive
+void lba_2_chs(int drive, uint32 lba, uint16* cyl, uint16* head, uint16* sector)
 {
-    lba_2_chs_f(18, lba, cyl, head, sector);
+    floppy_geometry_t *geometry = &floppy_drives[drive].geometry;
+    lba_2_chs_f(geometry->sectorsPerTrack, geometry->heads, lba, cyl, head, sector);
+}
+
+/*
+ * Returns how many bytes of a transfer starting at lba/address one READ/WRITE DATA command can move.
+ * With the MT bit set the controller runs from head 0 into head 1 by itself, so a command only
+ * has to stop at the end of the cylinder, or where the DMA controller would wrap inside its 64 KiB page.
+ * bounce is set if the buffer can't be used for DMA at all and the data has to go through a bounce buffer.
+ */
+uint32 floppy_transfer_length(int drive, uint32 lba, uint32 address, uint32 count, int *bounce)
+{
+    uint32 cylinderSectors = floppy_drives[drive].geometry.heads * floppy_drives[drive].geometry.sectorsPerTrack;
+    uint32 length = (cylinderSectors - (lba % cylinderSectors)) * FLOPPY_SECTOR_SIZE;
+
+    if(count < length){
+        length = count;
+    }
+
+    *bounce = 0;
+    if(dma_is_safe(address, length)){
+        return length;
+    }
+
+    // Move the whole sectors in front of the 64 KiB boundary straight into the buffer
+    // The rest follows with the next command
+    uint32 pageLeft = (0x10000 - (address & 0xFFFF)) & ~(FLOPPY_SECTOR_SIZE - 1);
+    if(pageLeft > 0 && dma_is_safe(address, pageLeft)){
+        return pageLeft;
+    }
+
+    // Above 16 MiB, or a sector straddles the boundary
+    *bounce = 1;
+    return length;
 }
 
 
@@ -149,14 +292,19 @@ void floppy_detect_drives() {
  * https://wiki.osdev.org/CMOS#Register_0x10
  * https://forum.osdev.org/viewtopic.php?t=13538
  */
-uint8 get_drive_type(){
-    // ask CMOS for floppy drive type
+uint8 get_drive_type(int drive){
+    // ask CMOS for floppy drive type, drive 0 is in the high nibble and drive 1 in the low one
     outb(0x70, 0x10);
     uint8 drives = inb(0x71);
-    if(drives >> 4 == 0){
-        return drives & 0xf;
+    uint8 type = 0;
+    if(drive == 0){
+        type = drives >> 4;
+    }
+    else if(drive == 1){
+        type = drives & 0xf;
     }
-    return drives >> 4;
+    // Anything past the 2.88MB drive is one we know nothing about
+    return type > 7 ? 7 : type;
 
 }
 
@@ -191,17 +339,324 @@ unsigned char floppy_read_data() {
 }
 
 
+/*
+ * IRQ6 handler, the controller raises it at the end of every seek, recalibrate and read/write
+ */
+void floppy_irq_handler(regs *r){
+    (void) r;
+    floppy_irq_received = 1;
+}
+
+/*
+ * Park the calling process until the controller raises IRQ6
+ * Other processes keep running during the seek or transfer
+ */
+void floppy_wait_irq(){
+    wait_event(&floppy_irq_received);
+}
+
+/*
+ * Turn the drive's motor on and wait until it is up to speed
+ * A motor that is already spinning (or idling) is used right away
+ */
+void floppy_motor_on(int drive){
+    floppy_drive_t *state = &floppy_drives[drive];
+
+    // The timer must not stop an idle motor while we are claiming it
+    asm volatile("cli");
+    if(state->motorState == FLOPPY_MOTOR_OFF){
+        state->motorDeadline = timer_get_ticks() + TIMER_MS_TO_TICKS(FLOPPY_SPINUP_MS);
+        state->motorState = FLOPPY_MOTOR_SPINNING_UP;
+        floppy_dor |= 1 << (4 + drive);
+        outb(FLOPPY_DIGITAL_OUTPUT_REGISTER, floppy_dor);
+    }
+    else if(state->motorState == FLOPPY_MOTOR_IDLE){
+        state->motorState = FLOPPY_MOTOR_ON;
+    }
+    asm volatile("sti");
+
+    // Someone (maybe another process) turned it on, wait for the rest of the spin-up
+    if(state->motorState == FLOPPY_MOTOR_SPINNING_UP){
+        int32 remaining = state->motorDeadline - timer_get_ticks();
+        if(remaining > 0){
+            timer_sleep(remaining);
+        }
+        state->motorState = FLOPPY_MOTOR_ON;
+    }
+}
+
+/*
+ * We are done with the drive for now, the timer turns the motor off once it has been idle for long enough
+ */
+void floppy_motor_off(int drive){
+    floppy_drives[drive].motorDeadline = timer_get_ticks() + floppy_motor_idle_ticks;
+    floppy_drives[drive].motorState = FLOPPY_MOTOR_IDLE;
+}
+
+/*
+ * Called on every timer tick, stops motors that were idle for too long
+ */
+void floppy_motor_tick(){
+    for(int drive = 0; drive < 4; drive++){
+        floppy_drive_t *state = &floppy_drives[drive];
+
+        if(state->motorState == FLOPPY_MOTOR_IDLE && (int32)(timer_get_ticks() - state->motorDeadline) >= 0){
+            state->motorState = FLOPPY_MOTOR_OFF;
+            floppy_dor &= ~(1 << (4 + drive));
+            outb(FLOPPY_DIGITAL_OUTPUT_REGISTER, floppy_dor);
+        }
+    }
+}
+
+// Set how long a motor keeps spinning after the last read or write
+void floppy_set_motor_timeout(uint32 ms){
+    floppy_motor_idle_ticks = TIMER_MS_TO_TICKS(ms);
+}
+
+// Returns the drive's CMOS type, 0 if there is no drive
+int floppy_get_drive_type(int drive){
+    return floppy_drives[drive].type;
+}
+
+// Returns the number of sectors on each track of the disk in the drive
+int floppy_get_sectors_per_track(int drive){
+    return floppy_drives[drive].geometry.sectorsPerTrack;
+}
+
+// Returns the number of sectors on the disk in the drive
+uint32 floppy_get_sector_count(int drive){
+    floppy_geometry_t *geometry = &floppy_drives[drive].geometry;
+    return geometry->cylinders * geometry->heads * geometry->sectorsPerTrack;
+}
+
+/*
+ * Tell the driver what shape the disk in the drive has (from its BPB)
+ * The data rate follows from the track length: 36 sectors is ED media at 1 Mbps,
+ * 15 or 18 is HD media at 500 Kbps, anything shorter is DD media at 250 Kbps (300 Kbps in a 1.2MB drive)
+ * Returns -1 if the drive can't take such a disk
+ */
+int floppy_set_geometry(int drive, uint32 sectorCount, uint16 sectorsPerTrack, uint16 heads){
+    floppy_drive_t *state = &floppy_drives[drive];
+
+    if(sectorsPerTrack == 0 || heads == 0 || heads > 2 || sectorsPerTrack > 36 ||
+       sectorCount == 0 || sectorCount / (sectorsPerTrack * heads) > 255){
+        return -1;
+    }
+
+    uint8 dataRate;
+    if(sectorsPerTrack >= 36){
+        dataRate = MB1;
+    }
+    else if(sectorsPerTrack >= 15){
+        dataRate = KB500;
+    }
+    else{
+        dataRate = state->type == 2 ? KB300 : KB250;
+    }
+
+    // Only a 2.88MB drive can run at 1 Mbps
+    if(dataRate == MB1 && state->type != 5){
+        return -1;
+    }
+
+    state->geometry.sectorsPerTrack = sectorsPerTrack;
+    state->geometry.heads = heads;
+    state->geometry.cylinders = sectorCount / (sectorsPerTrack * heads);
+    state->geometry.dataRate = dataRate;
+
+    // The new data rate goes to the controller with the next drive_select()
+    state->timingChanged = 1;
+    return 0;
+}
+
+// Returns the cylinder the drive's heads are on, or -1 if we don't know
+int floppy_get_cylinder(int drive){
+    return floppy_drives[drive].cylinder;
+}
+
+// Copy the drive's statistics into stats
+void floppy_get_stats(int drive, floppy_stats_t *stats){
+    *stats = floppy_drives[drive].stats;
+}
+
+/*
+ * A seek or transfer failed, move the drive one step towards the safe timings
+ * It has to go twice as long without a retry as last time before it tries the faster ones again
+ */
+void floppy_timing_error(int drive){
+    floppy_drive_t *state = &floppy_drives[drive];
+
+    state->cleanRun = 0;
+    if(floppy_auto_tune && state->timingLevel < FLOPPY_TIMING_LEVELS - 1){
+        state->timingLevel++;
+        state->timingChanged = 1;
+        state->stats.timingBackoffs++;
+        if(state->cleanNeeded < FLOPPY_TIMING_RECOVER_MAX) state->cleanNeeded *= 2;
+    }
+}
+
+/*
+ * A transfer went through on its first attempt, after a long enough run of them
+ * move the drive one step back towards the fast timings (an error there sends it back, see floppy_timing_error())
+ */
+void floppy_timing_clean(int drive){
+    floppy_drive_t *state = &floppy_drives[drive];
+
+    if(!floppy_auto_tune || state->timingLevel == 0){
+        return;
+    }
+
+    if(++state->cleanRun >= state->cleanNeeded){
+        state->cleanRun = 0;
+        state->timingLevel--;
+        state->timingChanged = 1;
+        state->stats.timingSpeedups++;
+    }
+}
+
+// Turn timing auto-tuning on (start from the fastest timings) or off (use the safe timings)
+void floppy_set_auto_tune(int enabled){
+    floppy_auto_tune = enabled;
+
+    for(int drive = 0; drive < 4; drive++){
+        floppy_drives[drive].timingLevel = enabled ? 0 : FLOPPY_TIMING_LEVELS - 1;
+        floppy_drives[drive].timingChanged = 1;
+    }
+}
+
+// The timing level a drive settled on, so it can be saved and handed back with floppy_set_timing_level()
+int floppy_get_timing_level(int drive){
+    return floppy_drives[drive].timingLevel;
+}
+
+void floppy_set_timing_level(int drive, int level){
+    if(level < 0) level = 0;
+    if(level >= FLOPPY_TIMING_LEVELS) level = FLOPPY_TIMING_LEVELS - 1;
+
+    floppy_drives[drive].timingLevel = level;
+    floppy_drives[drive].timingChanged = 1;
+}
+
+void floppy_print_stats(int drive){
+    floppy_stats_t *stats = &floppy_drives[drive].stats;
+    int level = floppy_drives[drive].timingLevel;
+
+    printf("Floppy drive ");
+    printint(drive);
+    printf(": ");
+    printint(stats->seeks);
+    printf(" seeks, ");
+    printint(stats->seeksAvoided);
+    printf(" seeks avoided\n");
+    printf(" - SRT ");
+    printint(floppy_timings[level][0]);
+    printf(", HLT ");
+    printint(floppy_timings[level][1]);
+    printf(", ");
+    printint(stats->timingBackoffs);
+    printf(" timing back-offs, ");
+    printint(stats->timingSpeedups);
+    printf(" speed-ups\n");
+    printf(" - ");
+    printf(drive_types[floppy_drives[drive].type]);
+    printf(" drive, ");
+    printint(floppy_drives[drive].geometry.sectorsPerTrack);
+    printf(" sectors per track, ");
+    printint(floppy_drives[drive].geometry.heads);
+    printf(" heads, ");
+    printint(floppy_drives[drive].geometry.cylinders);
+    printf(" cylinders\n");
+    printf(" - ");
+    printint(stats->retries);
+    printf(" retries, ");
+    printint(stats->recalibrations);
+    printf(" recalibrations, ");
+    printint(stats->crcErrors);
+    printf(" CRC errors, ");
+    printint(stats->overruns);
+    printf(" overruns, ");
+    printint(stats->failures);
+    printf(" failed transfers\n");
+    printf(" - write verify ");
+    printf(floppy_drives[drive].writeVerify ? "on, " : "off, ");
+    printint(stats->verifies);
+    printf(" verifies, ");
+    printint(stats->verifyFailures);
+    printf(" failed\n");
+}
+
+/*
+ * With write verify on, every WRITE DATA is followed by a VERIFY of the same sectors,
+ * so a write only succeeds once the controller has read it back with good CRCs
+ * Returns whether it was on before
+ */
+int floppy_set_write_verify(int drive, int enabled){
+    int previous = floppy_drives[drive].writeVerify;
+    floppy_drives[drive].writeVerify = enabled;
+    return previous;
+}
+
+// How the block device layer reaches our drives
+static const blkdev_ops_t floppy_blkdev_ops = {floppy_read, floppy_write, floppy_get_cylinder, 0, floppy_set_geometry,
+                                               floppy_set_write_verify};
+
+void floppy_install(){
+    // Nobody knows where the BIOS left the heads
+    for(int drive = 0; drive < 4; drive++){
+        floppy_drives[drive].cylinder = -1;
+        floppy_drives[drive].cleanRun = 0;
+        floppy_drives[drive].cleanNeeded = FLOPPY_TIMING_RECOVER_RUN;
+    }
+
+    // Motors the BIOS left running are treated as idle, so they get turned off eventually
+    floppy_dor = inb(FLOPPY_DIGITAL_OUTPUT_REGISTER) | 0x0C;
+    for(int drive = 0; drive < 4; drive++){
+        if(floppy_dor & (1 << (4 + drive))){
+            floppy_motor_off(drive);
+        }
+    }
+
+    irq_install_handler(floppy_irq, floppy_irq_handler);
+    timer_add_callback(floppy_motor_tick);
+
+    // Every drive starts out with the media its CMOS type takes
+    for(int drive = 0; drive < 4; drive++){
+        floppy_drives[drive].type = get_drive_type(drive);
+        floppy_drives[drive].geometry = floppy_geometries[floppy_drives[drive].type];
+    }
+
+    // Drive 0 is the one we booted from, drive 1 is only there if the CMOS says so
+    for(int drive = 0; drive < 2; drive++){
+        if(drive > 0 && floppy_drives[drive].type == 0) break;
+
+        blkdev_t device;
+        stringcopy(drive == 0 ? "fd0" : "fd1", device.name, 4);
+        device.unit = drive;
+        device.ops = &floppy_blkdev_ops;
+        device.sectorCount = floppy_get_sector_count(drive);
+        device.sectorsPerTrack = floppy_get_sectors_per_track(drive);
+        device.heads = floppy_drives[drive].geometry.heads;
+        blkdev_register(&device);
+    }
+}
+
+
 // Floppy Command Definitions
 
 void floppy_configure(int implied_seek, int FIFO, int drive_polling_mode, int threshold);
 void floppy_lock();
 void floppy_reset(int firstTime);
 void floppy_recalibrate(uint8  drive);
+int floppy_calibrate(int drive);
 void floppy_sense_interrupt(uint8 *st0, uint8 *cyl);
-void specify();
+int floppy_seek(int drive, int cyl, int head);
+void specify(int drive);
 void drive_select(int drive);
 void floppy_rw_command(int drive, int head, int cyl, int sect, int EOT, uint8 *st0, uint8 *st1, uint8 *st2,
-                       int *headResult, int *cylResult, int *sectResult, int command);
+                       int *headResult, int *cylResult, int *sectResult, int command, int sectorCount);
+floppy_error_t floppy_classify(uint8 st0, uint8 st1, uint8 st2);
+int floppy_retry_policy(int drive, floppy_error_t error, int attempt);
+floppy_error_t floppy_transfer(int drive, uint32 lba, void* address, uint32 count, int command);
 
 
 // Floppy Commands
@@ -230,28 +685,46 @@ int floppy_init(){
  * https://wiki.osdev.org/Floppy_Disk_Controller#Drive_Selection
  */
 void drive_select(int drive){
-    outb(FLOPPY_CONFIGURATION_CONTROL_REGISTER, 0); // This is usually correct, even tho it changes if not using 1.44Mb drive.
-    specify();
+    // The data rate and timings stay in the controller, only send them when they changed
+    if(drive != floppy_specified_drive || floppy_drives[drive].timingChanged){
+        uint8 dataRate = floppy_drives[drive].geometry.dataRate;
+        outb(FLOPPY_CONFIGURATION_CONTROL_REGISTER, dataRate);
+
+        // ED media is recorded perpendicularly, the controller has to know for which drives
+        // https://wiki.osdev.org/Floppy_Disk_Controller#Perpendicular_Mode_and_ED_Drives
+        uint8 perpendicular = 0;
+        for(int i = 0; i < 4; i++){
+            if(floppy_drives[i].geometry.dataRate == MB1) perpendicular |= 1 << (2 + i);
+        }
+        if(perpendicular != floppy_perpendicular){
+            floppy_write_cmd(FLOPPY_PERPENDICULAR_MODE);
+            floppy_write_cmd(0x80 | perpendicular);
+            floppy_perpendicular = perpendicular;
+        }
 
-    // Select drive in DOR and turn on its motor
-    uint8 DOR = inb(FLOPPY_DIGITAL_OUTPUT_REGISTER);
-    // turn off all motors | select drive | turn on drive's motor
-    DOR = (DOR & 0xC) | (drive | (1 << (4 + drive)));
-    outb(FLOPPY_DIGITAL_OUTPUT_REGISTER, DOR);
+        specify(drive);
+        floppy_specified_drive = drive;
+        floppy_drives[drive].timingChanged = 0;
+    }
+
+    // Select drive in DOR, the motors are left alone (see floppy_motor_on())
+    floppy_dor = (floppy_dor & 0xFC) | drive;
+    outb(FLOPPY_DIGITAL_OUTPUT_REGISTER, floppy_dor);
 }
 
 /*
  * https://wiki.osdev.org/Floppy_Disk_Controller#Specify
  */
-void specify(){
+void specify(int drive){
     /*
      * According to the OsDev wiki, these values should change according
      * to failed operation statistics for performance.
-     * but, because no1 uses floppies, performance isn't that important
-     * so, we'll just use very safe values
+     * The drive starts on the fastest values in floppy_timings (or the level saved on the last boot), floppy_timing_error()
+     * backs off towards the very safe values (SRT=8, HLT=5) when seeks or transfers fail,
+     * and floppy_timing_clean() tries the faster ones again after a long run without retries
      */
-    int SRT = 8;
-    int HLT = 5;
+    int SRT = floppy_timings[floppy_drives[drive].timingLevel][0];
+    int HLT = floppy_timings[floppy_drives[drive].timingLevel][1];
     int HUT = 0;
 
     floppy_write_cmd(FLOPPY_SPECIFY);
@@ -282,20 +755,70 @@ void floppy_lock(){
 
 /*
  * https://wiki.osdev.org/Floppy_Disk_Controller#Recalibrate
+ * Moves the heads back to cylinder 0, the motor has to be on
+ * Some controllers give up after 77 steps, so an 80 cylinder drive may need a second try
  */
+int floppy_calibrate(int drive){
+    for(int i = 0; i < FLOPPY_RECALIBRATE_ATTEMPTS; i++){
+        floppy_irq_received = 0;
+        floppy_write_cmd(FLOPPY_RECALIBRATE);
+        floppy_write_cmd(drive);
+
+        floppy_wait_irq();
+        uint8 st0 = 0;
+        uint8 cyl = 0;
+        floppy_sense_interrupt(&st0, &cyl);
+        floppy_drives[drive].stats.recalibrations++;
+
+        if((st0 & 0x20) && cyl == 0){
+            floppy_drives[drive].cylinder = 0;
+            return 0;
+        }
+    }
+
+    floppy_drives[drive].cylinder = -1;
+    return -1;
+}
+
 void floppy_recalibrate(uint8 drive){
-    floppy_write_cmd(FLOPPY_RECALIBRATE);
-    floppy_write_cmd(drive);
+    floppy_motor_on(drive);
+    floppy_calibrate(drive);
+    floppy_motor_off(drive);
+}
+
+
+/*
+ * https://wiki.osdev.org/Floppy_Disk_Controller#Seek
+ * Moves the heads to the cylinder, unless we know they are already there
+ */
+int floppy_seek(int drive, int cyl, int head){
+    floppy_drive_t *state = &floppy_drives[drive];
+
+    if(state->cylinder == cyl){
+        state->stats.seeksAvoided++;
+        return 0;
+    }
+
+    floppy_irq_received = 0;
+    floppy_write_cmd(FLOPPY_SEEK);
+    floppy_write_cmd((head << 2) | drive);
+    floppy_write_cmd(cyl);
 
-    irq_wait(floppy_irq);
+    floppy_wait_irq();
     uint8 st0 = 0;
-    uint8 cyl = 0;
-    floppy_sense_interrupt(&st0, &cyl);
+    uint8 cylOut = 0;
+    floppy_sense_interrupt(&st0, &cylOut);
+    state->stats.seeks++;
 
-    if(!(st0 & 0x20))
-        floppy_recalibrate(drive);
-}
+    // Seek end bit not set, or we ended up somewhere else
+    if(!(st0 & 0x20) || cylOut != cyl){
+        state->cylinder = -1;
+        return -1;
+    }
 
+    state->cylinder = cyl;
+    return 0;
+}
 
 /*
  * https://wiki.osdev.org/Floppy_Disk_Controller#Sense_Interrupt
@@ -303,13 +826,6 @@ void floppy_recalibrate(uint8 drive){
 void floppy_sense_interrupt(uint8 *st0, uint8 *cyl){
     floppy_write_cmd(FLOPPY_SENSE_INTERRUPT);
 
-    uint8 RQM;
-    while(1){
-        RQM = inb(FLOPPY_MAIN_STATUS_REGISTER) & 0x80;
-        if(RQM)
-            break;
-    }
-
     *st0 = floppy_read_data();
     *cyl = floppy_read_data();
 
@@ -319,147 +835,411 @@ void floppy_sense_interrupt(uint8 *st0, uint8 *cyl){
  * https://wiki.osdev.org/Floppy_Disk_Controller#Controller_Reset
  */
 void floppy_reset(int firstTime){
-    uint8 DOR = inb(FLOPPY_DIGITAL_OUTPUT_REGISTER);
+    floppy_irq_received = 0;
     outb(FLOPPY_DIGITAL_OUTPUT_REGISTER, 0);
     //sleep(10);
-    outb(FLOPPY_DIGITAL_OUTPUT_REGISTER, DOR & 0x8);
+
+    // The reset stopped every motor and we can no longer trust the head positions
+    // The controller also forgot the timings
+    for(int drive = 0; drive < 4; drive++){
+        floppy_drives[drive].motorState = FLOPPY_MOTOR_OFF;
+        floppy_drives[drive].cylinder = -1;
+    }
+    floppy_specified_drive = -1;
+    floppy_dor = 0x0C;
+    outb(FLOPPY_DIGITAL_OUTPUT_REGISTER, floppy_dor);
     if(!firstTime){ // check if IRQs were enabled
-        irq_wait(floppy_irq);
+        floppy_wait_irq();
     }
 }
 
 
 
 /*
- * https://wiki.osdev.org/Floppy_Disk_Controller#Read.2FWrite
+ * https://wiki.osdev.org/Floppy_Disk_Controller#Results
+ * Turns the status bytes of a READ/WRITE DATA command into the error that stopped it
+ * When more than one bit is set, the one that says most about the cause wins
  */
+floppy_error_t floppy_classify(uint8 st0, uint8 st1, uint8 st2){
+    int interruptCode = st0 >> 6;
+
+    if(interruptCode == 0 && !(st1 & 0x80)) return FLOPPY_OK;
+    if(interruptCode == 2) return FLOPPY_ERROR_INVALID_COMMAND;
+    if(st1 & 0x02) return FLOPPY_ERROR_WRITE_PROTECT;
+    if((st0 & 0x08) || interruptCode == 3) return FLOPPY_ERROR_NOT_READY;
+    if(st1 & 0x10) return FLOPPY_ERROR_OVERRUN;
+    if((st1 | st2) & 0x01) return FLOPPY_ERROR_MISSING_ADDRESS_MARK;
+    if((st1 & 0x20) || (st2 & 0x20)) return FLOPPY_ERROR_CRC;
+    if(st2 & 0x12) return FLOPPY_ERROR_SEEK;
+    if((st1 & 0x84) || (st2 & 0x44)) return FLOPPY_ERROR_NO_DATA;
+    return FLOPPY_ERROR_UNKNOWN;
+}
 
-int floppy_write(int drive, uint32 lba, void* address, uint16 count){
-    count--;
-    initFloppyDMA((uint32) address, count);
-
-    drive_select(drive);
-
-    uint16 cyl;
-    uint16 head;
-    uint16 sector;
-    lba_2_chs(lba, &cyl, &head, &sector);
-
-    int EOT = 19;
+char *floppy_error_name(floppy_error_t error){
+    switch(error){
+        case FLOPPY_OK:                             return "no error";
+        case FLOPPY_ERROR_CRC:                      return "CRC error";
+        case FLOPPY_ERROR_NO_DATA:                  return "sector not found";
+        case FLOPPY_ERROR_OVERRUN:                  return "DMA overrun";
+        case FLOPPY_ERROR_WRITE_PROTECT:            return "disk is write protected";
+        case FLOPPY_ERROR_MISSING_ADDRESS_MARK:     return "missing address mark";
+        case FLOPPY_ERROR_SEEK:                     return "seek error";
+        case FLOPPY_ERROR_NOT_READY:                return "drive not ready";
+        case FLOPPY_ERROR_INVALID_COMMAND:          return "invalid command";
+        case FLOPPY_ERROR_NO_BUFFER:                return "no DMA buffer";
+        default:                                    return "unknown error";
+    }
+}
 
-    uint8 st0;
-    uint8 st1;
-    uint8 st2;
-    int cylOut;
-    int headOut;
-    int sectOut;
+/*
+ * Decide what to do about a failed attempt, returns 0 if the transfer should be tried again
+ * - write protection, a bad command or a missing buffer won't go away by retrying
+ * - an overrun only means the DMA fell behind, so we try again right away
+ * - media errors slow the drive's timings down and wait a little longer each time,
+ *   from the second one on (and after any seek error) the heads are recalibrated too,
+ *   so a wrong idea of where they are can't fail every retry in the same way
+ */
+int floppy_retry_policy(int drive, floppy_error_t error, int attempt){
+    floppy_drive_t *state = &floppy_drives[drive];
+
+    // Don't trust the head position after a failed transfer
+    state->cylinder = -1;
+
+    switch(error){
+        case FLOPPY_ERROR_WRITE_PROTECT:
+        case FLOPPY_ERROR_INVALID_COMMAND:
+        case FLOPPY_ERROR_NO_BUFFER:
+            return -1;
+        case FLOPPY_ERROR_OVERRUN:
+            state->stats.overruns++;
+            break;
+        case FLOPPY_ERROR_CRC:
+            state->stats.crcErrors++;
+            // fall through
+        default:
+            floppy_timing_error(drive);
+            if(attempt > 0 || error == FLOPPY_ERROR_SEEK){
+                floppy_calibrate(drive);
+            }
+            timer_sleep(TIMER_MS_TO_TICKS(FLOPPY_RETRY_BACKOFF_MS << attempt));
+            drive_select(drive);
+            break;
+    }
 
+    if(attempt + 1 >= FLOPPY_MAX_ATTEMPTS){
+        return -1;
+    }
 
-    for(int i = 0; i < 20; i++){
+    state->stats.retries++;
+    return 0;
+}
 
-        prepare_for_floppyDMA_write();
+/*
+ * https://wiki.osdev.org/Floppy_Disk_Controller#Read.2FWrite
+ * Moves the buffer with as few READ/WRITE DATA commands as the cylinder and DMA page allow
+ * The motor has to be on already, see floppy_read() and floppy_write()
+ */
+floppy_error_t floppy_transfer(int drive, uint32 lba, void* address, uint32 count, int command){
+    int write = command == FLOPPY_WRITE_DATA;
 
-        floppy_rw_command(drive, head, cyl, sector, EOT, &st0, &st1, &st2, &headOut, &cylOut, &sectOut, FLOPPY_WRITE_DATA);
+    drive_select(drive);
 
-        int error = 0;
+    while(count > 0){
+        int needsBounce;
+        uint32 length = floppy_transfer_length(drive, lba, (uint32) address, count, &needsBounce);
+
+        // Buffers the DMA controller can't reach go through a bounce buffer
+        uint8 *bounce = 0;
+        uint32 dmaAddress = (uint32) address;
+        if(needsBounce){
+            bounce = dma_alloc(length);
+            if(!bounce){
+                return FLOPPY_ERROR_NO_BUFFER;
+            }
+            dmaAddress = (uint32) bounce;
+        }
 
-        if(st0 >> 6 == 2){error = 1;}
-        if(st1 & 0x80) {error = 1;}
-        if(st0 & 0x08) {error = 1;}
-        if(st0 >> 6 == 3){error = 1;}
-        if(st1 & 0x20) {error = 1;}
-        if(st1 & 0x10) {error = 1;}
-        if(st1 & 0x04) {error = 1;}
-        if((st1|st2) & 0x01) {error = 1;}
-        if(st2 & 0x40) {error = 1;}
-        if(st2 & 0x20) {error = 1;}
-        if(st2 & 0x10) {error = 1;}
-        if(st2 & 0x04) {error = 1;}
-        if(st2 & 0x02) {error = 1;}
-        if(st1 & 0x02) {error = 2;}
-        if(!error){
-            return 0;
+        uint16 cyl;
+        uint16 head;
+        uint16 sector;
+        lba_2_chs(drive, lba, &cyl, &head, &sector);
+
+        int EOT = floppy_drives[drive].geometry.sectorsPerTrack;
+
+        uint8 st0;
+        uint8 st1;
+        uint8 st2;
+        int cylOut;
+        int headOut;
+        int sectOut;
+
+        floppy_error_t error;
+        for(int attempt = 0; ; attempt++){
+
+            // Only seek if the heads are not on this cylinder already
+            if(floppy_seek(drive, cyl, head)){
+                error = FLOPPY_ERROR_SEEK;
+            }
+            else{
+                // A failed attempt stops the DMA channel short of its terminal count, so auto-init never
+                // reloaded its address and count, every attempt starts it over (and refills the bounce buffer)
+                if(bounce && write){
+                    memorycopy(address, bounce, length);
+                }
+                initFloppyDMA(dmaAddress, length - 1);
+
+                if(write){
+                    prepare_for_floppyDMA_write();
+                }
+                else{
+                    prepare_for_floppyDMA_read();
+                }
+
+                floppy_rw_command(drive, head, cyl, sector, EOT, &st0, &st1, &st2, &headOut, &cylOut, &sectOut,
+                                  command, length / FLOPPY_SECTOR_SIZE);
+                error = floppy_classify(st0, st1, st2);
+            }
+
+            // The controller reads what we just wrote back and checks the CRCs, nothing goes through the DMA
+            // A sector that fails is handled like a failed write, so the retry writes it again
+            if(error == FLOPPY_OK && write && floppy_drives[drive].writeVerify){
+                floppy_drives[drive].stats.verifies++;
+                floppy_rw_command(drive, head, cyl, sector, EOT, &st0, &st1, &st2, &headOut, &cylOut, &sectOut,
+                                  FLOPPY_VERIFY, length / FLOPPY_SECTOR_SIZE);
+                error = floppy_classify(st0, st1, st2);
+                if(error != FLOPPY_OK){
+                    floppy_drives[drive].stats.verifyFailures++;
+                }
+            }
+
+            if(error == FLOPPY_OK){
+                if(attempt == 0){
+                    floppy_timing_clean(drive);
+                }
+
+                // The result names the sector after the last one transferred, which is on the next
+                // cylinder when we ran to the end of head 1, the heads themselves did not move
+                floppy_drives[drive].cylinder = (cylOut == cyl + 1 && headOut == 0 && sectOut == 1) ? cyl : cylOut;
+                break;
+            }
+
+            if(floppy_retry_policy(drive, error, attempt)){
+                break;
+            }
         }
-        if(error > 1){
-            printf("Error writing floppy!");
-            return -2;
+
+        if(error != FLOPPY_OK){
+            floppy_drives[drive].stats.failures++;
+            dma_free(bounce, length);
+            printf(write ? "Error writing floppy: " : "Error reading floppy: ");
+            printf(floppy_error_name(error));
+            printf(" at LBA ");
+            printint(lba);
+            putchar('\n');
+            return error;
         }
 
-        printf("Error writing floppy!");
+        if(bounce && !write){
+            memorycopy(bounce, address, length);
+        }
+        dma_free(bounce, length);
 
+        lba += length / FLOPPY_SECTOR_SIZE;
+        address += length;
+        count -= length;
     }
-    printf("Error writing floppy!");
-    return -1;
+    return FLOPPY_OK;
 
 }
 
-int floppy_read(int drive, uint32 lba, void* address, uint16 count){
-    initFloppyDMA((uint32) address, count);
 
-    drive_select(drive);
+// Both return FLOPPY_OK, or the floppy_error_t that made the transfer give up
+// The controller is held for the whole transfer, so nobody else issues a command (or takes its IRQ) while we wait
+int floppy_write(int drive, uint32 lba, void* address, uint32 count){
+    lock_acquire(&floppy_controller_lock);
+    floppy_motor_on(drive);
+    int result = floppy_transfer(drive, lba, address, count, FLOPPY_WRITE_DATA);
+    floppy_motor_off(drive);
+    lock_release(&floppy_controller_lock);
+    return result;
+}
 
-    uint16 cyl;
-    uint16 head;
-    uint16 sector;
-    lba_2_chs(lba, &cyl, &head, &sector);
+int floppy_read(int drive, uint32 lba, void* address, uint32 count){
+    lock_acquire(&floppy_controller_lock);
+    floppy_motor_on(drive);
+    int result = floppy_transfer(drive, lba, address, count, FLOPPY_READ_DATA);
+    floppy_motor_off(drive);
+    lock_release(&floppy_controller_lock);
+    return result;
+}
 
-    int EOT = 19;
+/*
+ * How many sectors pass under the heads while they step to the next cylinder and settle
+ * Worked out for the slowest step rate we fall back to, a sector too many costs a little, one too few a whole turn
+ */
+int floppy_cylinder_skew(int drive){
+    uint32 stepMs = 16 - floppy_timings[FLOPPY_TIMING_LEVELS - 1][0];
+    uint32 sectorsPerTrack = floppy_drives[drive].geometry.sectorsPerTrack;
 
-    uint8 st0;
-    uint8 st1;
-    uint8 st2;
-    int cylOut;
-    int headOut;
-    int sectOut;
+    return ((stepMs + FLOPPY_HEAD_SETTLE_MS) * sectorsPerTrack + FLOPPY_ROTATION_MS - 1) / FLOPPY_ROTATION_MS;
+}
 
+// The gap between sectors FORMAT TRACK lays down, from the standard formats for each track length
+uint8 floppy_format_gap(int sectorsPerTrack){
+    if(sectorsPerTrack >= 36) return 0x54;
+    if(sectorsPerTrack >= 18) return 0x6C;
+    if(sectorsPerTrack >= 15) return 0x54;
+    return 0x50;
+}
 
-    for(int i = 0; i < 20; i++){
+/*
+ * Fill in the sector IDs (C, H, R, N) FORMAT TRACK writes, in the order they go around the track
+ * Sector 1 goes skew slots after the index hole and every next sector interleave slots after the one before,
+ * so a transfer that just reached this track, or is still busy with the last sector, finds its next sector soon
+ */
+void floppy_format_layout(int drive, int cyl, int head, int interleave, int skew, uint8 *table){
+    int sectorsPerTrack = floppy_drives[drive].geometry.sectorsPerTrack;
 
-        prepare_for_floppyDMA_read();
+    for(int slot = 0; slot < sectorsPerTrack; slot++){
+        table[slot * 4 + 2] = 0;
+    }
 
-        floppy_rw_command(drive, head, cyl, sector, EOT, &st0, &st1, &st2, &headOut, &cylOut, &sectOut, FLOPPY_READ_DATA);
+    int slot = skew % sectorsPerTrack;
+    for(int sector = 1; sector <= sectorsPerTrack; sector++){
+        // Interleaves that share a factor with the track length run into sectors already placed
+        while(table[slot * 4 + 2] != 0){
+            slot = (slot + 1) % sectorsPerTrack;
+        }
 
-        int error = 0;
+        table[slot * 4 + 0] = cyl;
+        table[slot * 4 + 1] = head;
+        table[slot * 4 + 2] = sector;
+        table[slot * 4 + 3] = 2;    // 512 bytes per sector
 
-        if(st0 >> 6 == 2){error = 1;}
-        if(st1 & 0x80) {error = 1;}
-        if(st0 & 0x08) {error = 1;}
-        if(st0 >> 6 == 3){error = 1;}
-        if(st1 & 0x20) {error = 1;}
-        if(st1 & 0x10) {error = 1;}
-        if(st1 & 0x04) {error = 1;}
-        if((st1|st2) & 0x01) {error = 1;}
-        if(st2 & 0x40) {error = 1;}
-        if(st2 & 0x20) {error = 1;}
-        if(st2 & 0x10) {error = 1;}
-        if(st2 & 0x04) {error = 1;}
-        if(st2 & 0x02) {error = 1;}
-        if(st1 & 0x02) {error = 2;}
-        if(!error){
-            return 0;
+        slot = (slot + interleave) % sectorsPerTrack;
+    }
+}
+
+/*
+ * https://wiki.osdev.org/Floppy_Disk_Controller#Format_Track
+ * Lays down one track with the sector IDs in table, the DMA controller feeds them to the controller
+ * Failures go through the same retry policy as reads and writes
+ */
+floppy_error_t floppy_format_track(int drive, int cyl, int head, uint8 *table){
+    int sectorsPerTrack = floppy_drives[drive].geometry.sectorsPerTrack;
+    floppy_error_t error;
+
+    for(int attempt = 0; ; attempt++){
+        if(floppy_seek(drive, cyl, head)){
+            error = FLOPPY_ERROR_SEEK;
         }
-        if(error > 1){
-            printf("Error reading floppy!");
-            return -2;
+        else{
+            initFloppyDMA((uint32) table, sectorsPerTrack * 4 - 1);
+            prepare_for_floppyDMA_write();
+
+            floppy_irq_received = 0;
+            floppy_write_cmd(0x40 | FLOPPY_FORMAT_TRACK);   // MFM
+            floppy_write_cmd((head << 2) | drive);
+            floppy_write_cmd(2);                            // 512 bytes per sector
+            floppy_write_cmd(sectorsPerTrack);
+            floppy_write_cmd(floppy_format_gap(sectorsPerTrack));
+            floppy_write_cmd(0xF6);                         // what the data fields are filled with
+
+            floppy_wait_irq();
+
+            uint8 st0 = floppy_read_data();
+            uint8 st1 = floppy_read_data();
+            uint8 st2 = floppy_read_data();
+
+            // The cylinder, head, sector and size bytes mean nothing after a format
+            for(int i = 0; i < 4; i++){
+                floppy_read_data();
+            }
+
+            error = floppy_classify(st0, st1, st2);
         }
 
+        if(error == FLOPPY_OK){
+            return FLOPPY_OK;
+        }
+
+        if(floppy_retry_policy(drive, error, attempt)){
+            break;
+        }
     }
-    printf("Error reading floppy!");
-    return -1;
 
+    floppy_drives[drive].stats.failures++;
+    printf("Error formatting floppy: ");
+    printf(floppy_error_name(error));
+    printf(" at cylinder ");
+    printint(cyl);
+    printf(" head ");
+    printint(head);
+    putchar('\n');
+    return error;
 }
 
+/*
+ * Format every track of the disk in the drive for its current geometry (see floppy_set_geometry())
+ * Track (c, h) starts c * (cylinderSkew + (heads - 1) * headSkew) + h * headSkew slots past the index hole,
+ * so sector 1 of the next track comes around just after a head switch or a step to the next cylinder
+ * A negative cylinderSkew is worked out from the step rate, see floppy_cylinder_skew()
+ * Returns FLOPPY_OK, or the floppy_error_t that made a track give up
+ */
+int floppy_format(int drive, int interleave, int headSkew, int cylinderSkew){
+    floppy_geometry_t *geometry = &floppy_drives[drive].geometry;
+
+    if(floppy_drives[drive].type == 0){
+        return FLOPPY_ERROR_NOT_READY;
+    }
+
+    if(interleave < 1) interleave = 1;
+    if(headSkew < 0) headSkew = 0;
+    if(cylinderSkew < 0) cylinderSkew = floppy_cylinder_skew(drive);
+
+    uint8 *table = dma_alloc(geometry->sectorsPerTrack * 4);
+    if(!table){
+        return FLOPPY_ERROR_NO_BUFFER;
+    }
 
+    lock_acquire(&floppy_controller_lock);
+    floppy_motor_on(drive);
+    drive_select(drive);
+
+    floppy_error_t error = FLOPPY_OK;
+    for(int cyl = 0; cyl < geometry->cylinders && error == FLOPPY_OK; cyl++){
+        for(int head = 0; head < geometry->heads && error == FLOPPY_OK; head++){
+            int skew = cyl * (cylinderSkew + (geometry->heads - 1) * headSkew) + head * headSkew;
+            floppy_format_layout(drive, cyl, head, interleave, skew, table);
+            error = floppy_format_track(drive, cyl, head, table);
+        }
+    }
+
+    floppy_motor_off(drive);
+    lock_release(&floppy_controller_lock);
+    dma_free(table, geometry->sectorsPerTrack * 4);
+    return error;
+}
+
+
+/*
+ * Issues READ DATA, WRITE DATA or VERIFY and waits for its result
+ * VERIFY moves no data, with EC set it checks sectorCount sectors and stops, the others run until the DMA count is done
+ */
 void floppy_rw_command(int drive, int head, int cyl, int sect, int EOT, uint8 *st0, uint8 *st1, uint8 *st2,
-                       int *headResult, int *cylResult, int *sectResult, int command) {
+                       int *headResult, int *cylResult, int *sectResult, int command, int sectorCount) {
     int MT = 0x80; // set to 0x80 to enable multi-track, or 0 to disable
     int MFM = 0x40; //set to 0x40 to enable magnetic-encoding-mode, or 0 to disable. According to the wiki this should always be on
 
+    // Anything raised before this command has nothing to do with it
+    floppy_irq_received = 0;
+
     // Read command = MT bit | MFM bit | 0x6
     floppy_write_cmd( MFM | MT | command);
 
     // First parameter byte = (head number << 2) | drive number (the drive number must match the currently selected drive!)
-    floppy_write_cmd((head << 2) | drive);
+    // VERIFY also sets EC (bit 7), so the last parameter byte is a sector count
+    floppy_write_cmd((command == FLOPPY_VERIFY ? 0x80 : 0) | (head << 2) | drive);
 
     // Second parameter byte = cylinder number
     floppy_write_cmd(cyl);
@@ -479,19 +1259,12 @@ void floppy_rw_command(int drive, int head, int cyl, int sect, int EOT, uint8 *s
     // Seventh parameter byte = 0x1b (GAP1 default size)
     floppy_write_cmd(0x1b);
 
-    // Eighth parameter byte = 0xff (all floppy drives use 512bytes per sector)
-    floppy_write_cmd(0xff);
-
-    uint8 RQM;
-    uint8 MSR;
-    while(1){
-        MSR = inb(FLOPPY_MAIN_STATUS_REGISTER);
-        RQM = (MSR & 0x80) > 1;
-        //printf(toString(MSR, 2));
-        //sleep(10);
-        if(RQM)
-            break;
-    }
+    // Eighth parameter byte = 0xff (all floppy drives use 512bytes per sector), or how many sectors VERIFY checks
+    floppy_write_cmd(command == FLOPPY_VERIFY ? sectorCount : 0xff);
+
+    // The controller raises IRQ6 once the transfer is done and the result bytes are ready
+    // Until then the calling process is parked and others can run
+    floppy_wait_irq();
 
     // First result byte = st0 status register
     *st0 = floppy_read_data();
@@ -1,5 +1,6 @@
 #include "./idt.h"
 #include "./io.h"
+#include "./multitasking.h"
 
 extern  void irq0();
 extern  void irq1();
@@ -52,7 +53,7 @@ void irq_remap(void)
     outb(0xA1, 0x0);
 }
 
-static volatile int currentInterrupts[15];
+static volatile int currentInterrupts[16];
 
 void irq_install()
 {
@@ -103,8 +104,8 @@ extern  void _irq_handler(regs *r)
     outb(0x20, 0x20);       // END OF INTERRUPT command to PIC1
 }
 
+// Park the calling process until IRQ n fires
 void irq_wait(int n){
-    while(!currentInterrupts[n]){};
-    currentInterrupts[n] = 0;
+    wait_event(&currentInterrupts[n]);
 
 }
\ No newline at end of file
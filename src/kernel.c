@@ -3,10 +3,26 @@
 #include "./irq.h"
 #include "./isr.h"
 #include "./fat.h"
+#include "./fdc.h"
+#include "./ata.h"
+#include "./cache.h"
+#include "./blkdev.h"
+#include "./ramdisk.h"
+#include "./timer.h"
 #include "./string.h"
 
+// Set to 1 to copy the boot floppy into a RAM disk at start-up and mount that instead
+#define USE_RAMDISK 0
+
+// The timing level each floppy drive tuned itself to is kept in this file on the boot disk, one byte per drive
+// so the drives don't have to go through the same errors again on every boot
+#define FLOPPY_TIMINGS_NAME "FLOPPY"
+#define FLOPPY_TIMINGS_EXT "CFG"
+
 void prockernel();
 void fileproc();
+void loadFloppyTimings();
+void saveFloppyTimings();
 
 int main() 
 {
@@ -20,6 +36,12 @@ int main()
 	idt_install();
     isrs_install();
     irq_install();
+	timer_install();
+	floppy_install();
+	ata_install();
+
+	// Devices complete their work through interrupts from here on
+	asm volatile("sti");
 
 	// Start executing the kernel process
 	startkernel(prockernel);
@@ -30,23 +52,37 @@ int main()
 void prockernel()
 {
 	// Create the user processes
-	createproc(fileproc, (void *) 0x10000);
+	// The stack grows down from just below the kernel image (loaded at 0x10000)
+	createproc(fileproc, (void *) 0xF000);
 
 	// Count how many processes are ready to run
 	int userprocs = ready_process_count();
 
 	printf("Kernel Process Started\n");
 	
-	// As long as there is 1 user process that is ready, yield to it so it can run
+	// As long as there is 1 user process that is ready or waiting on a device, keep running them
 	while(userprocs > 0)
 	{
-		// Yield to the user process
-		yield();
-		
-		printf("Kernel Process Resumed\n");
+		if(ready_process_count() > 0)
+		{
+			// Yield to the user process
+			yield();
 
-		// Count the remaining ready processes (if any)
-		userprocs = ready_process_count();
+			// Processes parked on a device hand the CPU back silently
+			if(waiting_process_count() == 0) printf("Kernel Process Resumed\n");
+		}
+		else
+		{
+			// Everybody is waiting on a device, sleep until the next interrupt
+			// Check again with interrupts off, an IRQ that woke somebody in between would otherwise wait for the next tick
+			// sti only takes effect after hlt, so an interrupt cannot slip in between (same as wait_event())
+			asm volatile("cli");
+			if(ready_process_count() == 0) asm volatile("sti; hlt");
+			asm volatile("sti");
+		}
+
+		// Count the remaining ready or waiting processes (if any)
+		userprocs = ready_process_count() + waiting_process_count();
 	}
 
 	printf("Kernel Process Terminated\n");
@@ -56,13 +92,26 @@ void prockernel()
 
 void fileproc()
 {	
-	init_fs();
+	int device = blkdev_find("fd0");
+
+#if USE_RAMDISK
+	// Work on a copy of the whole floppy in memory, changes go back to the floppy on every sync
+	int ramdisk = ramdisk_create(blkdev_get(device)->sectorCount);
+	if(ramdisk >= 0 && ramdisk_load(ramdisk, device, 0) == 0)
+	{
+		ramdisk_set_write_back(ramdisk, 1);
+		device = ramdisk;
+	}
+#endif
+
+	int mounted = init_fs(device) == 0;
+	if(mounted) loadFloppyTimings();
 	char input;
 
 	do
 	{
 		// Ask the user to make a selection
-		printf("Make a selection (c, d, r, w, q): ");
+		printf("Make a selection (c, d, r, w, s, f, q): ");
 		input = getchar();
 		putchar(input);
 		putchar('\n');
@@ -72,6 +121,48 @@ void fileproc()
 		{
 			break;
 		}
+		// Print the disk statistics
+		else if(input == 's')
+		{
+			floppy_print_stats(0);
+			ata_print_drives();
+			cache_print_stats();
+			continue;
+		}
+		// Format the disk in the second floppy drive and put an empty file system on it
+		else if(input == 'f')
+		{
+			int target = blkdev_find("fd1");
+			if(target < 0 || floppy_get_drive_type(1) == 0)
+			{
+				printf("Error: There is no second floppy drive!\n");
+				continue;
+			}
+
+			// Don't lay down a single track unless the file system will fit afterwards
+			if(canMakeFileSystem(target))
+			{
+				continue;
+			}
+
+			// Formatting wipes the whole disk, make sure that is what the user wants
+			printf("This erases everything on fd1! Type y to go on: ");
+			char answer = getchar();
+			putchar(answer);
+			putchar('\n');
+			if(answer != 'y')
+			{
+				continue;
+			}
+
+			printf("Formatting fd1...\n");
+			if(floppy_format(1, FLOPPY_FORMAT_INTERLEAVE, FLOPPY_FORMAT_HEAD_SKEW, floppy_cylinder_skew(1)) == 0 &&
+			   makeFileSystem(target) == 0)
+			{
+				printf("Done.\n");
+			}
+			continue;
+		}
 		// If the input was invalid, just restart loop
 		else if(input != 'c' && input != 'd' && input != 'r' && input != 'w')
 		{
@@ -92,7 +183,17 @@ void fileproc()
 		putchar('\n');
 
 		// Search the directory to see if there exists an entry that contains the file name and extension
-		char fileExists = openFile(filename, ext) == 0;
+		// Only the clusters we touch are read, deleting the file doesn't read any
+		int fd = openFile(filename, ext, FILE_MODE_READ_WRITE | FILE_MODE_LAZY);
+
+		// Only -3 says the file isn't there, after any other error (too many files open, a bad FAT, a read error)
+		// we can't tell, and creating it could leave two entries with the same name
+		if(fd < 0 && fd != -3)
+		{
+			printf("Error: Could not open the file!\n");
+			continue;
+		}
+		char fileExists = fd >= 0;
 
 		// If we actually found a file...
 		if(fileExists)
@@ -101,10 +202,7 @@ void fileproc()
 			if(input == 'd')
 			{
 				printf("Deleting File...\n");
-
-				// Open the file
-				openFile(filename, ext);
-				deleteFile();
+				deleteFile(fd);
 			}
 			// Read the file and print the contents to the display
 			else if(input == 'r')
@@ -112,22 +210,25 @@ void fileproc()
 				clearscreen();
 				printf("Reading File...\n");
 
-				// Read one byte from the file
-				uint8 byte = readNextByte();
+				// Read the file a sector's worth at a time
+				uint8 buffer[512];
+				int count = readFile(fd, buffer, sizeof(buffer));
 
 				// Print the contents of the file to the string
-				while(byte != (uint8)-2)
+				while(count > 0)
 				{
-					// Print the byte to the screen
-					if (byte != 0) putchar((char)byte);
+					// Print the bytes to the screen
+					for(int j = 0; j < count; j++)
+					{
+						if (buffer[j] != 0) putchar((char)buffer[j]);
+					}
 
-					// Read one byte from the file
-					byte = readNextByte();
+					count = readFile(fd, buffer, sizeof(buffer));
 				}
 
 				// Close the file
 				putchar('\n');
-				closeFile();
+				closeFile(fd);
 			}
 			// Allow the user to type in characters and write those to the file
 			else if(input == 'w')
@@ -140,6 +241,7 @@ void fileproc()
 				uint32 i = 0;
 				uint8 prevByte = 0;
 				uint8 byte = 0;
+				uint8 zeros[512] = {0};
 
 				// Let the user type in characters into the file (until they hit ENTER)
 				do
@@ -151,7 +253,7 @@ void fileproc()
 					{
 						// Print the character to the file
 						putchar((char)byte);
-						writeNextByte(byte);
+						writeFile(fd, &byte, 1);
 						i++;
 					}
 					else if(byte == '\n' && prevByte != '\n')
@@ -162,7 +264,7 @@ void fileproc()
 						printf("Type enter twice to close the file.\n");
 
 						// Fill up the remaining sector with 0's to move onto the next sector
-						writeBytes(0, 512 - (i % 512));
+						writeFile(fd, zeros, 512 - (i % 512));
 						i += 512 - (i % 512);
 					}
 					
@@ -170,17 +272,24 @@ void fileproc()
 				
 				// If we have not overwritten the entire sector, do so now
 				// This prevents nasty leftovers in the sector from old writes
-				writeBytes(0, 512 - i);
-				i += 512 - i;
+				if(i < 512)
+				{
+					writeFile(fd, zeros, 512 - i);
+					i += 512 - i;
+				}
 
 				// Close the file (save the results to the disk)
 				putchar('\n');
-				closeFile();
+				closeFile(fd);
 
 				clearscreen();
 			}
 			// We cannot create a new file with the same name! (Do nothing)
-			else if(input == 'c') printf("Error: Tried to create a file that already exists!\n");
+			else if(input == 'c')
+			{
+				printf("Error: Tried to create a file that already exists!\n");
+				closeFile(fd);
+			}
 		}
 		// If we didn't find the file...
 		else
@@ -199,6 +308,49 @@ void fileproc()
 		}	
 	}while(input != 'q');
 
+	if(mounted) saveFloppyTimings();
 	exit();
 }
 
+// Hand the timing levels saved on the last boot back to the floppy drives, if there are any
+void loadFloppyTimings()
+{
+	char filename[9] = FLOPPY_TIMINGS_NAME;
+	char ext[4] = FLOPPY_TIMINGS_EXT;
+
+	int fd = openFile(filename, ext, FILE_MODE_READ);
+	if(fd < 0) return;
+
+	uint8 levels[4];
+	if(readFile(fd, levels, 4) == 4)
+	{
+		for(int drive = 0; drive < 4; drive++)
+		{
+			floppy_set_timing_level(drive, levels[drive]);
+		}
+	}
+
+	closeFile(fd);
+}
+
+// Save the timing level every floppy drive is on now, the file is created the first time
+void saveFloppyTimings()
+{
+	char filename[9] = FLOPPY_TIMINGS_NAME;
+	char ext[4] = FLOPPY_TIMINGS_EXT;
+
+	if(!fileExists(filename, ext) && createFile(filename, ext)) return;
+
+	int fd = openFile(filename, ext, FILE_MODE_WRITE);
+	if(fd < 0) return;
+
+	uint8 levels[4];
+	for(int drive = 0; drive < 4; drive++)
+	{
+		levels[drive] = floppy_get_timing_level(drive);
+	}
+
+	writeFile(fd, levels, 4);
+	closeFile(fd);
+}
+
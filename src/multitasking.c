@@ -1,6 +1,7 @@
 #include "./types.h"
 #include "./multitasking.h"
 #include "./io.h"
+#include "./fat.h"
 
 // An array to hold all of the processes we create
 proc_t processes[MAX_PROCS];
@@ -18,6 +19,9 @@ proc_t *kernel;     // The kernel process
 int schedule()
 {
 
+    // Processes whose event arrived may run again
+    wake_waiting();
+
     // Starts index for the loop at the process that was created after the previous proccess
       int i = prev->pid + 1;
     
@@ -42,10 +46,41 @@ int schedule()
     return 0;
 }
 
+// Wake up every waiting process whose event has happened
+void wake_waiting()
+{
+    for (int i = 0; i < MAX_PROCS; i++)
+    {
+        proc_t *current = &processes[i];
+
+        if (current->status == PROC_STATUS_WAITING && *current->waitEvent)
+        {
+            current->status = PROC_STATUS_READY;
+        }
+    }
+}
+
+int waiting_process_count()
+{
+    int count = 0;
+
+    for (int i = 0; i < MAX_PROCS; i++)
+    {
+        if (processes[i].type == PROC_TYPE_USER && processes[i].status == PROC_STATUS_WAITING)
+        {
+            count++;
+        }
+    }
+
+    return count;
+}
+
 int ready_process_count()
 {
     int count = 0;
 
+    wake_waiting();
+
     for (int i = 0; i < MAX_PROCS; i++)
     {
         proc_t *current = &processes[i];
@@ -80,6 +115,14 @@ int createproc(void *func, char *stack)
     userproc.esp = stack; // assign top and bottom of the stack
     userproc.ebp = stack;
     userproc.eip = func;
+    userproc.eflags = 0x202; // Interrupts enabled, so devices can wake us up
+    userproc.waitEvent = 0;
+
+    // No files open yet
+    for(int i = 0; i < MAX_PROC_FILES; i++)
+    {
+        userproc.files[i].file = -1;
+    }
 
     // Assign a process ID and add process to process array
     userproc.pid = process_index;
@@ -107,6 +150,10 @@ int startkernel(void func())
     proc_t kernproc;
     kernproc.status = PROC_STATUS_RUNNING; // Processes start ready to run
     kernproc.type = PROC_TYPE_KERNEL;    // Process is a kernel process
+    for(int i = 0; i < MAX_PROC_FILES; i++)
+    {
+        kernproc.files[i].file = -1;
+    }
 
     // Assign a process ID and add process to process array
     kernproc.pid = process_index;
@@ -127,6 +174,9 @@ int startkernel(void func())
 // Context switch to the kernel process
 void exit()
 {
+    // Let go of the files the process left open, other processes may still share them
+    closeProcessFiles();
+
     // Check if the process is a user or kernel process
     if(running->type == PROC_TYPE_USER) {
         prev = running;
@@ -169,6 +219,49 @@ void yield()
     return;
 }
 
+// Park the running process until *event becomes non-zero (usually set by an IRQ handler)
+// Other processes get to run in the meantime, the event is cleared again before returning
+void wait_event(volatile int *event)
+{
+    while(!*event)
+    {
+        if(running != 0 && running->type == PROC_TYPE_USER)
+        {
+            // Switch to the kernel, the scheduler skips us until the event happens
+            running->status = PROC_STATUS_WAITING;
+            running->waitEvent = event;
+            prev = running;
+            next = kernel;
+            contextswitch();
+            running = next;
+            running->status = PROC_STATUS_RUNNING;
+        }
+        else
+        {
+            // Nobody to hand the CPU to, sleep until the next interrupt
+            // sti only takes effect after hlt, so an interrupt cannot slip in between
+            asm volatile("cli");
+            if(!*event) asm volatile("sti; hlt");
+            asm volatile("sti");
+        }
+    }
+
+    *event = 0;
+}
+
+// Take a lock, sleeping until the process holding it lets go
+// Only one waiter gets it when it is released, the others go back to sleep
+void lock_acquire(sleeplock_t *lock)
+{
+    wait_event(&lock->free);
+}
+
+// Let go of a lock, a process sleeping on it gets it the next time the scheduler runs
+void lock_release(sleeplock_t *lock)
+{
+    lock->free = 1;
+}
+
 // Performs a context switch, switching from "running" to "next"
 void contextswitch()
 {
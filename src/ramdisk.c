@@ -0,0 +1,270 @@
+#include "./types.h"
+#include "./io.h"
+#include "./blkdev.h"
+#include "./ramdisk.h"
+#include "./string.h"
+
+/*
+ * RAM disks
+ *
+ * A block of memory registered as a block device (rd0, rd1), so the FAT code can mount it like a floppy.
+ * A RAM disk can be filled from another device at boot (ramdisk_load()), which then becomes its backing store.
+ * With write-back on, sectors written since the last sync are copied back to the backing store
+ * when the block device layer flushes the disk (cache_sync() does that).
+ */
+
+typedef struct
+{
+    int used;
+    int device;             // our number in the block device layer
+    uint8 *address;
+    uint32 sectorCount;
+    int backing;            // the device we were loaded from, -1 if none
+    uint32 backingLba;      // where on it our sector 0 is
+    int writeBack;
+    uint8 dirty[RAMDISK_MAX_SECTORS / 8];
+} ramdisk_t;
+
+static ramdisk_t ramdisks[RAMDISK_MAX_DISKS];
+
+// The next free byte above the first MiB
+static uint32 ramdisk_next_address = RAMDISK_ADDRESS;
+
+/*
+ * https://wiki.osdev.org/A20_Line#Fast_A20_Gate
+ * Returns 0 if addresses above 1 MiB no longer wrap around
+ */
+int a20_enable(){
+    volatile uint32 *low = (uint32 *) 0x7DFC;               // inside the boot sector, we are done with it
+    volatile uint32 *high = (uint32 *) (0x100000 + 0x7DFC); // the same address with bit 20 set
+    uint32 saved = *low;
+
+    uint8 value = inb(0x92);
+    if(!(value & 0x02)){
+        // Bit 0 would reset the machine
+        outb(0x92, (value | 0x02) & ~0x01);
+    }
+
+    *low = 0x12345678;
+    *high = ~0x12345678;
+    int wrapped = *low != 0x12345678;
+
+    *low = saved;
+    return wrapped ? -1 : 0;
+}
+
+uint8 cmos_read(uint8 reg){
+    outb(0x70, reg);
+    return inb(0x71);
+}
+
+/*
+ * Where the RAM above the first MiB ends, from what the BIOS noted down in the CMOS at boot
+ * Registers 0x34/0x35 count the 64 KiB blocks above 16 MiB, 0x30/0x31 the KiB above 1 MiB (at most 64 MiB)
+ */
+uint32 memory_end(){
+    uint64 above16 = cmos_read(0x34) | (cmos_read(0x35) << 8);
+    if(above16){
+        uint64 end = 0x1000000 + (above16 << 16);
+        return end > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32) end;
+    }
+
+    uint32 above1 = cmos_read(0x30) | (cmos_read(0x31) << 8);
+    return 0x100000 + above1 * 1024;
+}
+
+ramdisk_t *ramdisk_get(int device){
+    for(int i = 0; i < RAMDISK_MAX_DISKS; i++){
+        if(ramdisks[i].used && ramdisks[i].device == device){
+            return &ramdisks[i];
+        }
+    }
+    return 0;
+}
+
+int ramdisk_read(int unit, uint32 lba, void *address, uint32 count){
+    ramdisk_t *disk = &ramdisks[unit];
+
+    if(lba >= disk->sectorCount || count / BLKDEV_SECTOR_SIZE > disk->sectorCount - lba){
+        return -1;
+    }
+
+    memorycopy(disk->address + lba * BLKDEV_SECTOR_SIZE, address, count);
+    return 0;
+}
+
+int ramdisk_write(int unit, uint32 lba, void *address, uint32 count){
+    ramdisk_t *disk = &ramdisks[unit];
+    uint32 sectors = count / BLKDEV_SECTOR_SIZE;
+
+    if(lba >= disk->sectorCount || sectors > disk->sectorCount - lba){
+        return -1;
+    }
+
+    memorycopy(address, disk->address + lba * BLKDEV_SECTOR_SIZE, count);
+
+    for(uint32 i = lba; i < lba + sectors; i++){
+        disk->dirty[i / 8] |= 1 << (i % 8);
+    }
+    return 0;
+}
+
+/*
+ * Called when a write back of ramdisk_flush() completes, the request points into the disk's memory
+ * The sectors are clean only if the backing store took them, a failed write leaves them for the next flush
+ */
+void ramdisk_flush_complete(blkdev_request_t *request){
+    if(request->status != 0){
+        return;
+    }
+
+    for(int i = 0; i < RAMDISK_MAX_DISKS; i++){
+        ramdisk_t *disk = &ramdisks[i];
+        uint8 *address = (uint8 *) request->address;
+        if(!disk->used || address < disk->address || address >= disk->address + disk->sectorCount * BLKDEV_SECTOR_SIZE){
+            continue;
+        }
+
+        uint32 lba = (address - disk->address) / BLKDEV_SECTOR_SIZE;
+        for(uint32 sector = lba; sector < lba + request->count / BLKDEV_SECTOR_SIZE; sector++){
+            disk->dirty[sector / 8] &= ~(1 << (sector % 8));
+        }
+        return;
+    }
+}
+
+/*
+ * Copy the sectors written since the last flush back to the backing store, runs of them in one request
+ * Does nothing unless write-back is on
+ */
+int ramdisk_flush(int unit){
+    ramdisk_t *disk = &ramdisks[unit];
+
+    if(!disk->writeBack || disk->backing < 0){
+        return 0;
+    }
+
+    blkdev_request_t requests[BLKDEV_MAX_REQUESTS];
+    int requestCount = 0;
+    int error = 0;
+
+    uint32 lba = 0;
+    while(lba < disk->sectorCount){
+        if(!(disk->dirty[lba / 8] & (1 << (lba % 8)))){
+            lba++;
+            continue;
+        }
+
+        uint32 runLength = 0;
+        while(lba + runLength < disk->sectorCount && (disk->dirty[(lba + runLength) / 8] & (1 << ((lba + runLength) % 8)))){
+            runLength++;
+        }
+
+        blkdev_request_t request = {disk->backing, 1, disk->backingLba + lba,
+                                    disk->address + lba * BLKDEV_SECTOR_SIZE, runLength * BLKDEV_SECTOR_SIZE, 0,
+                                    ramdisk_flush_complete};
+        blkdev_queue(requests, &requestCount, &request, &error);
+        lba += runLength;
+    }
+
+    int result = blkdev_submit(requests, requestCount);
+    if(result && !error) error = result;
+    return error;
+}
+
+// How the block device layer reaches our disks
+static const blkdev_ops_t ramdisk_blkdev_ops = {ramdisk_read, ramdisk_write, 0, ramdisk_flush, 0, 0};
+
+/*
+ * Set aside memory for a RAM disk of sectorCount sectors and register it as rd0 or rd1
+ * Returns its block device number, or -1 if there is no memory or no free slot left
+ */
+int ramdisk_create(uint32 sectorCount){
+    int unit = 0;
+    while(unit < RAMDISK_MAX_DISKS && ramdisks[unit].used){
+        unit++;
+    }
+
+    uint32 size = sectorCount * BLKDEV_SECTOR_SIZE;
+    if(unit == RAMDISK_MAX_DISKS || sectorCount == 0 || sectorCount > RAMDISK_MAX_SECTORS ||
+       size > RAMDISK_MEMORY_END - ramdisk_next_address){
+        return -1;
+    }
+
+    if(a20_enable()){
+        printf("Error: Could not enable the A20 line!\n");
+        return -1;
+    }
+
+    ramdisk_t *disk = &ramdisks[unit];
+    disk->address = (uint8 *) ramdisk_next_address;
+    disk->sectorCount = sectorCount;
+    disk->backing = -1;
+    disk->backingLba = 0;
+    disk->writeBack = 0;
+    for(uint32 i = 0; i < sizeof(disk->dirty); i++){
+        disk->dirty[i] = 0;
+    }
+
+    blkdev_t device;
+    stringcopy("rd0", device.name, 4);
+    device.name[2] += unit;
+    device.unit = unit;
+    device.ops = &ramdisk_blkdev_ops;
+    device.sectorCount = sectorCount;
+    device.sectorsPerTrack = 0;
+    device.heads = 0;
+
+    disk->device = blkdev_register(&device);
+    if(disk->device < 0){
+        return -1;
+    }
+
+    disk->used = 1;
+    ramdisk_next_address += size;
+    return disk->device;
+}
+
+/*
+ * Fill the RAM disk with the sectors of source starting at sourceLba, one cylinder's worth at a time
+ * source becomes the RAM disk's backing store, see ramdisk_set_write_back()
+ */
+int ramdisk_load(int device, int source, uint32 sourceLba){
+    ramdisk_t *disk = ramdisk_get(device);
+    blkdev_t *sourceDevice = blkdev_get(source);
+
+    if(!disk || !sourceDevice || sourceLba >= sourceDevice->sectorCount ||
+       disk->sectorCount > sourceDevice->sectorCount - sourceLba){
+        return -1;
+    }
+
+    // Ask for whole cylinders, devices without tracks get the same size
+    uint32 chunk = sourceDevice->sectorsPerTrack * sourceDevice->heads;
+    if(chunk == 0) chunk = 36;
+
+    for(uint32 lba = 0; lba < disk->sectorCount; lba += chunk){
+        if(chunk > disk->sectorCount - lba){
+            chunk = disk->sectorCount - lba;
+        }
+
+        int error = blkdev_read(source, sourceLba + lba, disk->address + lba * BLKDEV_SECTOR_SIZE, chunk * BLKDEV_SECTOR_SIZE);
+        if(error){
+            return error;
+        }
+    }
+
+    disk->backing = source;
+    disk->backingLba = sourceLba;
+    for(uint32 i = 0; i < sizeof(disk->dirty); i++){
+        disk->dirty[i] = 0;
+    }
+    return 0;
+}
+
+// With write-back on, every flush copies the sectors that changed back to the device the disk was loaded from
+void ramdisk_set_write_back(int device, int enabled){
+    ramdisk_t *disk = ramdisk_get(device);
+    if(disk){
+        disk->writeBack = enabled;
+    }
+}
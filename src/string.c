@@ -20,4 +20,26 @@ void stringcopy(char *src, char *dest, int length)
     {
         dest[i] = src[i];
     }
+}
+
+// Copies 4 bytes at a time with rep movsd, then the 0 - 3 bytes left over with rep movsb
+// The buffers must not overlap
+void memorycopy(void *src, void *dest, uint32 length)
+{
+    uint32 words = length / 4;
+    uint32 bytes = length % 4;
+
+    asm volatile("rep movsl" : "+S"(src), "+D"(dest), "+c"(words) : : "memory");
+    asm volatile("rep movsb" : "+S"(src), "+D"(dest), "+c"(bytes) : : "memory");
+}
+
+// Fills length bytes with value, 4 at a time with rep stosd
+void memoryset(void *dest, uint8 value, uint32 length)
+{
+    uint32 words = length / 4;
+    uint32 bytes = length % 4;
+    uint32 pattern = value * 0x01010101;
+
+    asm volatile("rep stosl" : "+D"(dest), "+c"(words) : "a"(pattern) : "memory");
+    asm volatile("rep stosb" : "+D"(dest), "+c"(bytes) : "a"(pattern) : "memory");
 }
\ No newline at end of file
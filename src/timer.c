@@ -0,0 +1,82 @@
+#include "./types.h"
+#include "./io.h"
+#include "./irq.h"
+#include "./multitasking.h"
+#include "./timer.h"
+
+// The PIT's input clock, divided down to get TIMER_HZ
+#define PIT_FREQUENCY 1193180
+
+// The maximum number of functions that are called on every tick
+#define MAX_TIMER_CALLBACKS 4
+
+// Ticks since timer_install() was called
+static volatile uint32 timer_ticks = 0;
+
+// Set on every tick, processes sleeping in timer_sleep() are parked on it
+static volatile int timer_tick_event = 0;
+
+static void (*timer_callbacks[MAX_TIMER_CALLBACKS])();
+
+/*
+ * IRQ0 handler, counts ticks and runs the registered callbacks
+ * Callbacks run inside the interrupt, so they must be short and must not wait
+ */
+void timer_handler(regs *r)
+{
+    (void) r;
+    timer_ticks++;
+    timer_tick_event = 1;
+
+    for(int i = 0; i < MAX_TIMER_CALLBACKS; i++)
+    {
+        if(timer_callbacks[i]) timer_callbacks[i]();
+    }
+}
+
+/*
+ * https://wiki.osdev.org/Programmable_Interval_Timer
+ * Program channel 0 as a rate generator running at TIMER_HZ and hook IRQ0
+ */
+void timer_install()
+{
+    uint16 divisor = PIT_FREQUENCY / TIMER_HZ;
+
+    outb(0x43, 0x36);               // channel 0, lobyte/hibyte, rate generator
+    outb(0x40, divisor & 0xFF);
+    outb(0x40, (divisor >> 8) & 0xFF);
+
+    irq_install_handler(0, timer_handler);
+}
+
+uint32 timer_get_ticks()
+{
+    return timer_ticks;
+}
+
+// Park the calling process for at least the given number of ticks
+void timer_sleep(uint32 ticks)
+{
+    uint32 target = timer_ticks + ticks;
+
+    while((int32)(target - timer_ticks) > 0)
+    {
+        wait_event(&timer_tick_event);
+    }
+}
+
+// Register a function to be called on every tick
+// Returns -1 if all callback slots are taken
+int timer_add_callback(void (*callback)())
+{
+    for(int i = 0; i < MAX_TIMER_CALLBACKS; i++)
+    {
+        if(timer_callbacks[i] == 0)
+        {
+            timer_callbacks[i] = callback;
+            return 0;
+        }
+    }
+
+    return -1;
+}